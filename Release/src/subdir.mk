@@ -4,28 +4,43 @@
 
 # Add inputs and outputs from these tool invocations to the build variables 
 CPP_SRCS += \
+../src/BatchSync.cpp \
 ../src/Cycles.cpp \
+../src/Decomposition.cpp \
 ../src/Enumeration.cpp \
 ../src/Model.cpp \
 ../src/MonteCarloCycles.cpp \
+../src/PackedState.cpp \
+../src/StateWriter.cpp \
+../src/SyncGraph.cpp \
 ../src/Utilities.cpp \
 ../src/WalkCycle.cpp \
 ../src/main.cpp 
 
 OBJS += \
+./src/BatchSync.o \
 ./src/Cycles.o \
+./src/Decomposition.o \
 ./src/Enumeration.o \
 ./src/Model.o \
 ./src/MonteCarloCycles.o \
+./src/PackedState.o \
+./src/StateWriter.o \
+./src/SyncGraph.o \
 ./src/Utilities.o \
 ./src/WalkCycle.o \
 ./src/main.o 
 
 CPP_DEPS += \
+./src/BatchSync.d \
 ./src/Cycles.d \
+./src/Decomposition.d \
 ./src/Enumeration.d \
 ./src/Model.d \
 ./src/MonteCarloCycles.d \
+./src/PackedState.d \
+./src/StateWriter.d \
+./src/SyncGraph.d \
 ./src/Utilities.d \
 ./src/WalkCycle.d \
 ./src/main.d 
@@ -35,7 +50,7 @@ CPP_DEPS += \
 src/%.o: ../src/%.cpp
 	@echo 'Building file: $<'
 	@echo 'Invoking: Cross G++ Compiler'
-	g++ -std=c++11 -O3 -pedantic -Wall -c -fmessage-length=0 -MMD -MP -MF"$(@:%.o=%.d)" -MT"$(@:%.o=%.d)" -o "$@" "$<"
+	g++ -std=c++11 -O3 -pthread -pedantic -Wall -c -fmessage-length=0 -MMD -MP -MF"$(@:%.o=%.d)" -MT"$(@:%.o=%.d)" -o "$@" "$<"
 	@echo 'Finished building: $<'
 	@echo ' '
 
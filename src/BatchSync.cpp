@@ -0,0 +1,201 @@
+// Brian Goldman
+
+// Bit sliced implementation of synchronous updates
+#include "BatchSync.h"
+#include <cstring>
+
+// WideOps values are only ever passed around inside the inlined kernel,
+// so never across a function call whose ABI depends on AVX being enabled
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+namespace {
+// Loads, stores and constants for each word size the kernel can use
+struct NarrowOps {
+  typedef uint64_t Word;
+  static const size_t words = 1;
+  static Word load(const uint64_t* p) {
+    return *p;
+  }
+  static void store(uint64_t* p, Word value) {
+    *p = value;
+  }
+  static Word zero() {
+    return 0;
+  }
+};
+
+// Four words at a time using GCC vector types, which become single AVX2
+// instructions inside BatchSync::step_avx2 without needing -mavx2 for the whole build.
+struct WideOps {
+  typedef uint64_t Word __attribute__((vector_size(32)));
+  static const size_t words = 4;
+  __attribute__((always_inline)) static Word load(const uint64_t* p) {
+    Word value;
+    std::memcpy(&value, p, sizeof(value));
+    return value;
+  }
+  __attribute__((always_inline)) static void store(uint64_t* p, const Word& value) {
+    std::memcpy(p, &value, sizeof(value));
+  }
+  __attribute__((always_inline)) static Word zero() {
+    return Word { 0, 0, 0, 0 };
+  }
+};
+}
+
+bool BatchSync::wide() {
+  static const bool avx2 = __builtin_cpu_supports("avx2");
+  return avx2;
+}
+
+size_t BatchSync::width() {
+  return 64 * (wide() ? WideOps::words : NarrowOps::words);
+}
+
+bool BatchSync::supported(const Model& model) {
+  for (const auto & interaction : model.get_interactions()) {
+    if (interaction.lower_bound < -1 or interaction.upper_bound > 1) {
+      return false;
+    }
+  }
+  return true;
+}
+
+BatchSync::BatchSync(const Model& model_)
+    : model(model_),
+      length(model_.size()),
+      sliced(supported(model_)),
+      words(width() / 64) {
+  const uint64_t all = ~uint64_t(0);
+  for (const auto & interaction : model.get_interactions()) {
+    source_start.push_back(sources.size());
+    sources.insert(sources.end(), interaction.activators.begin(),
+                   interaction.activators.end());
+    inhibitor_start.push_back(sources.size());
+    sources.insert(sources.end(), interaction.inhibitors.begin(),
+                   interaction.inhibitors.end());
+    // Moving up: -1 -> 0, 0 -> 1 if allowed, 1 stays 1.
+    // Positive after moving up if you weren't negative and upper_bound allows it.
+    // Negative after moving up only if you are stuck at -1.
+    up_positive.insert(up_positive.end(), words,
+                       interaction.upper_bound > 0 ? all : 0);
+    up_negative.insert(up_negative.end(), words,
+                       interaction.upper_bound < 0 ? all : 0);
+    // Moving down mirrors moving up
+    down_positive.insert(down_positive.end(), words,
+                         interaction.lower_bound > 0 ? all : 0);
+    down_negative.insert(down_negative.end(), words,
+                         interaction.lower_bound < 0 ? all : 0);
+  }
+  source_start.push_back(sources.size());
+  positive.resize(length * words);
+  negative.resize(length * words);
+  next_positive.resize(length * words);
+  next_negative.resize(length * words);
+}
+
+// Always inlined so step_avx2 compiles its own copy using AVX2
+template<typename Ops>
+__attribute__((always_inline)) inline void BatchSync::step() const {
+  typedef Ops ops;
+  typedef typename Ops::Word Word;
+  for (size_t w = 0; w < words; w += ops::words) {
+    for (size_t position = 0; position < length; position++) {
+      const size_t activator = source_start[position];
+      const size_t inhibitor = inhibitor_start[position];
+      const size_t end = source_start[position + 1];
+      const size_t offset = position * words + w;
+      Word current_positive = ops::load(&positive[offset]);
+      Word current_negative = ops::load(&negative[offset]);
+      // The max of a list is positive if any are positive, and negative only if all are negative
+      Word active_positive = ops::zero();
+      Word active_negative = ~ops::zero();
+      for (size_t i = activator; i < inhibitor; i++) {
+        active_positive = active_positive | ops::load(&positive[sources[i] * words + w]);
+        active_negative = active_negative & ops::load(&negative[sources[i] * words + w]);
+      }
+      Word inhibit_positive = ops::zero();
+      Word inhibit_negative = ~ops::zero();
+      for (size_t i = inhibitor; i < end; i++) {
+        inhibit_positive = inhibit_positive | ops::load(&positive[sources[i] * words + w]);
+        inhibit_negative = inhibit_negative & ops::load(&negative[sources[i] * words + w]);
+      }
+      // Direction of change is split into "wants up" and "wants down"
+      Word wants_up, wants_down;
+      if (inhibitor == end) {
+        if (activator == end) {
+          // If you have neither activators or inhibitors, you just keep your state
+          wants_up = current_positive;
+          wants_down = current_negative;
+        } else {
+          // Line 2 in Equation 2
+          wants_up = active_positive;
+          wants_down = active_negative;
+        }
+      } else if (activator == inhibitor) {
+        // Line 3 in Equation 2, with negation swapping the planes
+        wants_up = inhibit_negative;
+        wants_down = inhibit_positive;
+      } else {
+        // Line 1 in Equation 2
+        wants_up = active_positive & ~inhibit_positive;
+        wants_down = inhibit_positive & ~active_positive;
+      }
+      // Gradual change. Anything that doesn't want to move falls to 0, which
+      // is no bits set in either plane.
+      Word up_pos = ~current_negative & ops::load(&up_positive[offset]);
+      Word up_neg = current_negative & ops::load(&up_negative[offset]);
+      Word down_pos = current_positive & ops::load(&down_positive[offset]);
+      Word down_neg = ~current_positive & ops::load(&down_negative[offset]);
+      ops::store(&next_positive[offset],
+                 (wants_up & up_pos) | (wants_down & down_pos));
+      ops::store(&next_negative[offset],
+                 (wants_up & up_neg) | (wants_down & down_neg));
+    }
+  }
+}
+
+__attribute__((target("avx2"))) void BatchSync::step_avx2() const {
+  step<WideOps>();
+}
+
+void BatchSync::get_sync_next(vector<vector<int>>& states) const {
+  if (not sliced) {
+    for (auto & state : states) {
+      state = model.get_sync_next(state);
+    }
+    return;
+  }
+  const size_t block = width();
+  for (size_t first = 0; first < states.size(); first += block) {
+    size_t count = std::min(block, states.size() - first);
+    // Transpose the states into bit planes
+    std::fill(positive.begin(), positive.end(), 0);
+    std::fill(negative.begin(), negative.end(), 0);
+    for (size_t j = 0; j < count; j++) {
+      const auto & state = states[first + j];
+      const uint64_t bit = uint64_t(1) << (j % 64);
+      const size_t w = j / 64;
+      for (size_t position = 0; position < length; position++) {
+        positive[position * words + w] |= bit & -uint64_t(state[position] > 0);
+        negative[position * words + w] |= bit & -uint64_t(state[position] < 0);
+      }
+    }
+    if (words == WideOps::words) {
+      step_avx2();
+    } else {
+      step<NarrowOps>();
+    }
+    // Transpose the results back out
+    for (size_t j = 0; j < count; j++) {
+      auto & state = states[first + j];
+      const size_t shift = j % 64;
+      const size_t w = j / 64;
+      for (size_t position = 0; position < length; position++) {
+        int up = (next_positive[position * words + w] >> shift) & 1;
+        int down = (next_negative[position * words + w] >> shift) & 1;
+        state[position] = up - down;
+      }
+    }
+  }
+}
@@ -0,0 +1,53 @@
+// Brian Goldman
+
+// Performs synchronous updates on a whole block of states at once using
+// bit slicing. Every variable must stay within -1 to 1, which lets each value
+// be stored as two bit planes: "positive" (value > 0) and "negative" (value < 0).
+// Bit j of a plane belongs to state j of the block, so the trinary logic of
+// Equation 2 and the gradual change rule become word wide boolean operations.
+// Processors with AVX2 process 256 states per pass instead of 64, which is checked
+// when the program runs so no special compiler flags are needed.
+#ifndef BATCHSYNC_H_
+#define BATCHSYNC_H_
+
+#include "Model.h"
+#include <cstdint>
+
+class BatchSync {
+ public:
+  BatchSync(const Model& model_);
+  // Returns true if every variable of "model" stays within -1 to 1
+  static bool supported(const Model& model);
+  // True if this processor can run the 256 state kernel
+  static bool wide();
+  // How many states are evaluated by each pass of the bit sliced kernel
+  static size_t width();
+  // Replaces every state in "states" with the result of doing a synchronous update.
+  // Falls back to Model::get_sync_next if the model cannot be bit sliced.
+  void get_sync_next(vector<vector<int>>& states) const;
+ private:
+  const Model& model;
+  size_t length;
+  bool sliced;
+  // How many 64 bit words make up one plane
+  size_t words;
+  // Flattened activators followed by inhibitors for each position, laid out
+  // the same way as in Model.
+  vector<size_t> sources;
+  vector<size_t> source_start;
+  vector<size_t> inhibitor_start;
+  // For each position, masks selecting what a target becomes
+  // when it moves up or down, based on that position's bounds.
+  vector<uint64_t> up_positive, up_negative;
+  vector<uint64_t> down_positive, down_negative;
+  // Bit planes for the current block of states and their updates
+  mutable vector<uint64_t> positive, negative;
+  mutable vector<uint64_t> next_positive, next_negative;
+  // Applies the synchronous update to the bit planes using the word size of "Ops"
+  template<typename Ops>
+  void step() const;
+  // step for 256 states at a time, compiled for AVX2 processors
+  void step_avx2() const;
+};
+
+#endif /* BATCHSYNC_H_ */
@@ -2,7 +2,14 @@
 
 // Brute force find all synchronous update cycles
 #include "Cycles.h"
+#include "BatchSync.h"
+#include "StateWriter.h"
+#include "PackedState.h"
 #include <unordered_set>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include <iterator>
 
 Cycles::Cycles(const Model& model_)
     : model(model_) {
@@ -39,49 +46,215 @@ bool less_than(const vector<int> & left, const vector<int>& right) {
 
 void Cycles::find_cycles(std::ostream& out) {
   model.print_header(out);
+  StateWriter writer(model, out);
 
-  std::unordered_set<vector<int>> known_cycle;
+  StatePacker packer(model);
+  StateSet known_cycle(packer);
+  StateMap<size_t> path_position(packer);
 
   // Initialize the counter to the minimum value
   vector<int> counter;
   for (const auto interaction : model.get_interactions()) {
     counter.push_back(interaction.lower_bound);
   }
-  do {
-    // If you have seen this step before, skip it
-    if (known_cycle.count(counter)) {
-      continue;
+  // Start states are processed in blocks so their first step can be
+  // computed by the bit sliced synchronous update.
+  BatchSync batch(model);
+  vector<vector<int>> block, block_next;
+  bool more = true;
+  while (more) {
+    block.clear();
+    while (more and block.size() < BatchSync::width()) {
+      block.push_back(counter);
+      more = increment(counter);
     }
-    // copy the start states to the beginning of the path
-    vector<vector<int>> path(1, counter);
-    unordered_map<vector<int>, size_t> path_position;
-    size_t end_of_path = 0;
-    path_position[path.back()] = end_of_path;
-
-    do {
-      // advance the path by 1
-      path.emplace_back(model.get_sync_next(path.back()));
-      end_of_path++;
-      auto result = path_position.insert( { path.back(), end_of_path });
-      // If this state already has a position in our path
-      if (not result.second) {
-        size_t start_of_cycle = result.first->second;
-        // Output the length of the cycle
-        out << end_of_path - start_of_cycle << std::endl;
-        // Write all of the states for this cycle to the file
-        for (size_t i = start_of_cycle; i < end_of_path; i++) {
-          model.print(path[i], out);
-          known_cycle.insert(path[i]);
+    block_next = block;
+    batch.get_sync_next(block_next);
+    for (size_t b = 0; b < block.size(); b++) {
+      // If you have seen this step before, skip it
+      if (known_cycle.count(block[b])) {
+        continue;
+      }
+      // copy the start states to the beginning of the path
+      vector<vector<int>> path(1, block[b]);
+      path_position.clear();
+      size_t end_of_path = 0;
+      path_position[path.back()] = end_of_path;
+
+      do {
+        // advance the path by 1
+        if (end_of_path == 0) {
+          path.emplace_back(block_next[b]);
+        } else {
+          path.emplace_back(model.get_sync_next(path.back()));
+        }
+        end_of_path++;
+        auto result = path_position.insert(path.back(), end_of_path);
+        // If this state already has a position in our path
+        if (not result.second) {
+          size_t start_of_cycle = *result.first;
+          // Output the length of the cycle
+          writer.flush();
+          out << end_of_path - start_of_cycle << std::endl;
+          // Write all of the states for this cycle to the file
+          for (size_t i = start_of_cycle; i < end_of_path; i++) {
+            writer.write(path[i]);
+            known_cycle.insert(path[i]);
+          }
+          writer.flush();
+          out << std::endl;
+        }
+        // Cycles must start from their lowest point. If you ever backtrack you know
+        // this cycle was already found by someone else, or you don't need to explore it
+        if (less_than(path.back(), path[0])) {
+          break;
+        }
+
+        // loop as long as you haven't connected back to something we've seen before
+      } while (known_cycle.count(path.back()) == 0);
+    }
+  }
+}
+
+bool Cycles::dense_supported(const Model& model) {
+  // One bit per state, so this allows up to 2 GB of bitmap
+  return model.state_space_size() <= double(uint64_t(1) << 34);
+}
+
+void Cycles::find_cycles_dense(std::ostream& out, size_t threads) {
+  if (not dense_supported(model)) {
+    throw std::invalid_argument("State space is too large for a visited bitmap");
+  }
+  const size_t total = model.state_space_size();
+  // A set bit means following that state leads to a cycle that
+  // has already been claimed by some worker.
+  vector<std::atomic<uint64_t>> visited((total + 63) / 64);
+  for (auto & word : visited) {
+    word.store(0, std::memory_order_relaxed);
+  }
+  auto is_visited = [&visited](size_t rank) {
+    return (visited[rank / 64].load(std::memory_order_relaxed) >> (rank % 64)) & 1;
+  };
+  // Returns true if "rank" was not already set
+  auto visit = [&visited](size_t rank) {
+    uint64_t bit = uint64_t(1) << (rank % 64);
+    return (visited[rank / 64].fetch_or(bit, std::memory_order_relaxed) & bit) == 0;
+  };
+
+  // Workers claim blocks of consecutive start ranks
+  const size_t block_size = BatchSync::width();
+  std::atomic<size_t> next_block(0);
+  // Each cycle is stored as its lowest rank and its states, starting from that lowest state
+  typedef std::pair<size_t, vector<vector<int>>> Found;
+  vector<vector<Found>> found(std::max<size_t>(threads, 1));
+
+  auto worker = [&](size_t id) {
+    BatchSync batch(model);
+    vector<vector<int>> block, block_next;
+    vector<vector<int>> path;
+    vector<size_t> path_ranks;
+    unordered_map<size_t, size_t> path_position;
+    vector<int> state(model.size());
+    size_t first;
+    while ((first = block_size * next_block++) < total) {
+      size_t last = std::min(first + block_size, total);
+      block.clear();
+      for (size_t rank = first; rank < last; rank++) {
+        if (not is_visited(rank)) {
+          model.unrank(rank, state);
+          block.push_back(state);
         }
-        out << std::endl;
       }
-      // Cycles must start from their lowest point. If you ever backtrack you know
-      // this cycle was already found by someone else, or you don't need to explore it
-      if (less_than(path.back(), path[0])) {
-        break;
+      block_next = block;
+      batch.get_sync_next(block_next);
+      for (size_t b = 0; b < block.size(); b++) {
+        size_t start = model.rank(block[b]);
+        path.assign(1, block[b]);
+        path_ranks.assign(1, start);
+        path_position.clear();
+        path_position[start] = 0;
+        bool resolved = false;
+        while (true) {
+          // advance the path by 1
+          if (path.size() == 1) {
+            path.push_back(block_next[b]);
+          } else {
+            state = path.back();
+            for (size_t i = 0; i < state.size(); i++) {
+              state[i] = model.get_next_state(i, path.back());
+            }
+            path.push_back(state);
+          }
+          size_t rank = model.rank(path.back());
+          // Cycles are only claimed from their lowest state, so anything
+          // that drops below the start is left to whoever starts lower.
+          if (rank < start) {
+            break;
+          }
+          // Everything on this path leads to a cycle that was already claimed
+          if (is_visited(rank)) {
+            resolved = true;
+            break;
+          }
+          auto result = path_position.insert( { rank, path_ranks.size() });
+          path_ranks.push_back(rank);
+          // If this state already has a position in our path
+          if (not result.second) {
+            size_t start_of_cycle = result.first->second;
+            size_t end_of_path = path_ranks.size() - 1;
+            size_t lowest = start_of_cycle;
+            for (size_t i = start_of_cycle; i < end_of_path; i++) {
+              if (path_ranks[i] < path_ranks[lowest]) {
+                lowest = i;
+              }
+            }
+            // Only one worker can claim a cycle
+            if (visit(path_ranks[lowest])) {
+              vector<vector<int>> cycle(path.begin() + lowest,
+                                        path.begin() + end_of_path);
+              cycle.insert(cycle.end(), path.begin() + start_of_cycle,
+                           path.begin() + lowest);
+              found[id].emplace_back(path_ranks[lowest], cycle);
+            }
+            resolved = true;
+            break;
+          }
+        }
+        if (resolved) {
+          for (const auto rank : path_ranks) {
+            visit(rank);
+          }
+        }
       }
+    }
+  };
+  vector<std::thread> workers;
+  for (size_t t = 1; t < found.size(); t++) {
+    workers.emplace_back(worker, t);
+  }
+  worker(0);
+  for (auto & thread : workers) {
+    thread.join();
+  }
 
-      // loop as long as you haven't connected back to something we've seen before
-    } while (known_cycle.count(path.back()) == 0);
-  } while (increment(counter));
+  vector<Found> cycles;
+  for (auto & list : found) {
+    std::move(list.begin(), list.end(), std::back_inserter(cycles));
+  }
+  std::sort(cycles.begin(), cycles.end(),
+            [](const Found& a, const Found& b) {
+    return a.first < b.first;
+  });
+  model.print_header(out);
+  StateWriter writer(model, out);
+  for (const auto & cycle : cycles) {
+    // Output the length of the cycle
+    writer.flush();
+    out << cycle.second.size() << std::endl;
+    for (const auto & state : cycle.second) {
+      writer.write(state);
+    }
+    writer.flush();
+    out << std::endl;
+  }
 }
@@ -12,6 +12,13 @@ class Cycles {
   Cycles(const Model& model_);
   // Will write cycles to "out" as they are found, stopping once the space is exhausted.
   void find_cycles(std::ostream& out);
+  // Finds the same cycles using "threads" workers which share an atomic bitmap
+  // of visited states, indexed by Model::rank. Each cycle is written starting
+  // from its lowest state, with cycles sorted by that lowest state.
+  // Only usable if "dense_supported".
+  void find_cycles_dense(std::ostream& out, size_t threads);
+  // Returns true if the model's state space is small enough for the visited bitmap
+  static bool dense_supported(const Model& model);
  private:
   const Model& model;
   // Given a list of states, find the next lowest state position.
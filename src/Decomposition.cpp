@@ -0,0 +1,142 @@
+// Brian Goldman
+
+// Enumerates each weakly connected component separately and
+// combines the results.
+
+#include "Decomposition.h"
+#include "Enumeration.h"
+#include <atomic>
+#include <thread>
+#include <iomanip>
+
+using std::cout;
+using std::endl;
+
+Decomposition::Decomposition(const Model& model_, const string& ordering)
+    : model(model_) {
+  auto names = model.components();
+  // Reserve first so the models never move once built
+  components.reserve(names.size());
+  for (const auto & component : names) {
+    components.emplace_back(model, component, ordering);
+  }
+  clamps.resize(components.size());
+}
+
+void Decomposition::clamp(const string& name, int low, int high) {
+  for (size_t c = 0; c < components.size(); c++) {
+    size_t position = components[c].find_position(name);
+    if (position < components[c].size()) {
+      clamps[c].push_back( { position, low, high });
+      return;
+    }
+  }
+  throw std::invalid_argument("Unable to clamp unknown variable: " + name);
+}
+
+void Decomposition::enumerate(std::ostream& out, size_t threads, bool expand,
+                              StateWriter::Format format) {
+  // Check the settings before starting any work
+  if (not expand and format != StateWriter::TEXT) {
+    throw std::invalid_argument(
+        "Factored output is only available in the text format");
+  }
+  vector<Enumeration> enumerations;
+  for (size_t c = 0; c < components.size(); c++) {
+    enumerations.emplace_back(components[c]);
+    for (const auto & limit : clamps[c]) {
+      enumerations.back().clamp(limit.position, limit.low, limit.high);
+    }
+  }
+  // Components are handed out to workers as they become idle
+  vector<vector<vector<int>>> states(components.size());
+  std::atomic<size_t> next_component(0);
+  auto worker = [&]() {
+    size_t c;
+    while ((c = next_component++) < components.size()) {
+      states[c] = enumerations[c].collect();
+    }
+  };
+  vector<std::thread> workers;
+  for (size_t t = 1; t < std::min(threads, components.size()); t++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto & thread : workers) {
+    thread.join();
+  }
+
+  // The total can easily be too large for an integer
+  double total = 1;
+  size_t iterations = 0;
+  for (size_t c = 0; c < components.size(); c++) {
+    total *= states[c].size();
+    iterations += enumerations[c].get_iterations();
+  }
+  cout << "Components: " << components.size() << endl;
+  if (expand) {
+    StateWriter writer(model, out, format);
+    if (format == StateWriter::TEXT) {
+      model.print_header(out);
+    }
+    expand_product(states, writer);
+  } else {
+    out << "# Components: " << components.size() << endl;
+    for (size_t c = 0; c < components.size(); c++) {
+      out << "# Component " << c << " Count: " << states[c].size() << endl;
+      components[c].print_header(out);
+      StateWriter writer(components[c], out);
+      for (const auto & state : states[c]) {
+        writer.write(state);
+      }
+    }
+  }
+  if (format == StateWriter::TEXT) {
+    out << "# Count: " << std::fixed << std::setprecision(0) << total
+        << std::defaultfloat << endl;
+  }
+  cout << "Count: " << std::fixed << std::setprecision(0) << total
+       << std::defaultfloat << endl;
+  cout << "Iterations: " << iterations << endl;
+}
+
+void Decomposition::expand_product(
+    const vector<vector<vector<int>>>& states, StateWriter& writer) const {
+  for (const auto & options : states) {
+    if (options.empty()) {
+      return;
+    }
+  }
+  // mapping[c][i] gives the full model position of component c's position i
+  vector<vector<size_t>> mapping(components.size());
+  for (size_t c = 0; c < components.size(); c++) {
+    const auto & interactions = components[c].get_interactions();
+    for (const auto & interaction : interactions) {
+      mapping[c].push_back(model.find_position(interaction.target_name));
+    }
+  }
+  // Mixed-radix counter over the choice made for each component, with
+  // the last component changing fastest
+  vector<size_t> choice(components.size(), 0);
+  vector<int> full(model.size(), 0);
+  for (size_t c = 0; c < components.size(); c++) {
+    for (size_t i = 0; i < mapping[c].size(); i++) {
+      full[mapping[c][i]] = states[c][0][i];
+    }
+  }
+  while (true) {
+    writer.write(full);
+    // Advance the counter, carrying into earlier components
+    size_t c = components.size();
+    do {
+      if (c == 0) {
+        return;
+      }
+      c--;
+      choice[c] = (choice[c] + 1) % states[c].size();
+      for (size_t i = 0; i < mapping[c].size(); i++) {
+        full[mapping[c][i]] = states[c][choice[c]][i];
+      }
+    } while (choice[c] == 0);
+  }
+}
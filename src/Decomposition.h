@@ -0,0 +1,47 @@
+// Brian Goldman
+
+// Finds all stable states of a model whose interaction graph splits into
+// weakly connected components. Components share no activators or inhibitors, so
+// the stable states of the whole model are exactly the Cartesian product of
+// each component's stable states. Enumerating every component on its own turns
+// the product of their search spaces into a sum.
+
+#ifndef DECOMPOSITION_H_
+#define DECOMPOSITION_H_
+
+#include "Model.h"
+#include "StateWriter.h"
+#include <ostream>
+
+class Decomposition {
+ public:
+  // Splits "model_" into components, with each component's variables
+  // assigned positions using "ordering".
+  Decomposition(const Model& model_, const string& ordering = "greedy");
+  size_t size() const {
+    return components.size();
+  }
+  // Only search states where "name" is between "low" and "high" (inclusive).
+  void clamp(const string& name, int low, int high);
+  // Enumerates each component using up to "threads" workers. Writes each component's
+  // stable states under its own header, or if "expand" writes every stable state of the
+  // full model in "format" instead.
+  void enumerate(std::ostream& out, size_t threads, bool expand,
+                 StateWriter::Format format = StateWriter::TEXT);
+ private:
+  const Model& model;
+  // Each component as a model of its own
+  vector<Model> components;
+  // Clamps stored by component as position, low, high
+  struct Clamp {
+    size_t position;
+    int low;
+    int high;
+  };
+  vector<vector<Clamp>> clamps;
+  // Writes the Cartesian product of "states" using the full model's positions
+  void expand_product(const vector<vector<vector<int>>>& states,
+                      StateWriter& writer) const;
+};
+
+#endif /* DECOMPOSITION_H_ */
@@ -7,6 +7,13 @@
 
 #include "Enumeration.h"
 #include <algorithm>
+#include <atomic>
+#include <functional>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <fstream>
+#include <cstdio>
 
 using std::cout;
 using std::endl;
@@ -14,57 +21,105 @@ using std::endl;
 Enumeration::Enumeration(const Model & model_)
     : model(model_),
       length(model_.size()),
-      affects_of(length, std::unordered_set<size_t>()),
       index_needs_change(length, 0),
       target_needs_change(length, 0),
-      total_changes_needed(0) {
-
+      total_changes_needed(0),
+      iterations(0),
+      count(0),
+      format(StateWriter::TEXT),
+      count_only(false),
+      collected(nullptr),
+      checkpoint_interval(0),
+      report_interval(10),
+      last_report_iterations(0),
+      start_fraction(0),
+      skips(length, 0) {
+  // affects_of[X] gives you the set of affected positions when
+  // "X" is changed
+  vector<vector<size_t>> affects_of(length);
   for (const auto & interaction : model.get_interactions()) {
+    if (&interaction != &model.get_interactions()[interaction.target]) {
+      throw std::invalid_argument(
+          "Index mismatch between target and interaction number");
+    }
     // Maps activators and inhibitors to the targets they affect
     for (const auto index : interaction.activators) {
-      affects_of[index].insert(interaction.target);
+      affects_of[index].push_back(interaction.target);
     }
     for (const auto index : interaction.inhibitors) {
-      affects_of[index].insert(interaction.target);
+      affects_of[index].push_back(interaction.target);
     }
     // A target changing effects itself
-    affects_of[interaction.target].insert(interaction.target);
+    affects_of[interaction.target].push_back(interaction.target);
+  }
+  // Freeze into a single contiguous array
+  const auto & interactions = model.get_interactions();
+  for (auto & targets : affects_of) {
+    std::sort(targets.begin(), targets.end());
+    targets.erase(std::unique(targets.begin(), targets.end()), targets.end());
+    std::stable_sort(targets.begin(), targets.end(),
+                     [&interactions](size_t a, size_t b) {
+      return interactions[a].minimum_dependency < interactions[b].minimum_dependency;
+    });
+    affects_start.push_back(affects.size());
+    for (const auto target : targets) {
+      affects.push_back( { target, interactions[target].minimum_dependency });
+    }
+  }
+  affects_start.push_back(affects.size());
+  for (const auto & interaction : interactions) {
+    lower.push_back(interaction.lower_bound);
+    upper.push_back(interaction.upper_bound);
   }
 }
 
+void Enumeration::clamp(size_t position, int low, int high) {
+  const auto & interaction = model.get_interactions().at(position);
+  if (low > high or low < interaction.lower_bound
+      or high > interaction.upper_bound) {
+    throw std::invalid_argument(
+        "Clamp of " + interaction.target_name + " to " + std::to_string(low)
+            + ".." + std::to_string(high) + " is outside of its range");
+  }
+  lower[position] = low;
+  upper[position] = high;
+}
+
 void Enumeration::make_move(size_t index, int newstate) {
   reference[index] = newstate;
-  for (const auto affected : affects_of[index]) {
-    // Get get the interaction that needs to be updated now that "index" has changed
-    const auto & interaction = model.get_interactions()[affected];
-    if (affected != interaction.target) {
-      throw std::invalid_argument(
-          "Index mismatch between target and interaction number");
-    }
-    // check to see if the interaction is stable
-    int desired = interaction.get_next_state(reference);
-    int needs_change = desired != reference[affected];
+  const Affected * current = affects.data() + affects_start[index];
+  const Affected * end = affects.data() + affects_start[index + 1];
+  while (current < end) {
+    // Everything that shares a minimum dependency updates the same bin,
+    // so total up their changes and apply them together
+    const size_t bin = current->minimum_dependency;
+    int bin_delta = 0;
+    for (; current < end and current->minimum_dependency == bin; current++) {
+      const size_t affected = current->target;
+      // check to see if the interaction is stable
+      int desired = model.get_next_state(affected, reference);
+      int needs_change = desired != reference[affected];
 
-    // 4 states:
-    // * needs change now and did so before = 1 - 1 = 0
-    // * needs change now and did not before = 1 - 0 = +1
-    // * doesn't need change now, did before = 0 - 1 = -1
-    // * doesn't need change now, didn't before = 0 - 0 = 0
-    int delta = needs_change - target_needs_change[affected];
-    index_needs_change[interaction.minimum_dependency] += delta;
-    total_changes_needed += delta;
-    target_needs_change[affected] = needs_change;
+      // 4 states:
+      // * needs change now and did so before = 1 - 1 = 0
+      // * needs change now and did not before = 1 - 0 = +1
+      // * doesn't need change now, did before = 0 - 1 = -1
+      // * doesn't need change now, didn't before = 0 - 0 = 0
+      bin_delta += needs_change - target_needs_change[affected];
+      target_needs_change[affected] = needs_change;
+    }
+    index_needs_change[bin] += bin_delta;
+    total_changes_needed += bin_delta;
   }
 }
 
-size_t Enumeration::increment(size_t index) {
-  const auto & interactions = model.get_interactions();
+size_t Enumeration::increment(size_t index, size_t limit) {
   // Perform carry operations
-  while (reference[index] == interactions[index].upper_bound) {
+  while (reference[index] == upper[index]) {
     // reduce it from maximum to minimum
-    make_move(index, interactions[index].lower_bound);
+    make_move(index, lower[index]);
     index++;
-    if (index >= length) {
+    if (index >= limit) {
       return index;
     }
   }
@@ -79,7 +134,7 @@ void Enumeration::rebuild_changes_needed() {
   target_needs_change.assign(length, 0);
   total_changes_needed = 0;
   for (const auto& interaction : model.get_interactions()) {
-    int desired = interaction.get_next_state(reference);
+    int desired = model.get_next_state(interaction.target, reference);
     int needs_change = desired != reference[interaction.target];
     index_needs_change[interaction.minimum_dependency] += needs_change;
     target_needs_change[interaction.target] = needs_change;
@@ -87,26 +142,17 @@ void Enumeration::rebuild_changes_needed() {
   }
 }
 
-void Enumeration::enumerate(std::ostream& out) {
-  // start all variables at lower bound
-  reference.resize(length);
-  for (size_t i = 0; i < length; i++) {
-    reference[i] = model.get_interactions()[i].lower_bound;
-  }
-  rebuild_changes_needed();
-
-  // tracks how many stable states are found
-  size_t count = 0;
-
-  model.print_header(out);
-
-  size_t index = length - 1;
-  size_t iterations = 0;
+void Enumeration::search(size_t split, size_t index, StateWriter& writer) {
   while (true) {
     iterations++;
     // If a local optima has been found, output it
     if (total_changes_needed == 0) {
-      model.print(reference, out);
+      if (not count_only) {
+        writer.write(reference);
+      }
+      if (collected) {
+        collected->push_back(reference);
+      }
       count++;
     }
     // Hyperplanes let you skip areas below the highest
@@ -114,27 +160,364 @@ void Enumeration::enumerate(std::ostream& out) {
     while (index > 0 and index_needs_change[index] == 0) {
       index--;
     }
+    // Nothing else in this subspace can be a steady state
+    if (index >= split) {
+      return;
+    }
     // increment that index
-    index = increment(index);
+    skips[index]++;
+    index = increment(index, split);
     // End is reached
-    if (index >= length) {
-      cout << endl;
-      out << "# Count: " << count << endl;
-      cout << "Count: " << count << endl;
+    if (index >= split) {
       return;
     }
 
-    // Everything below here is just for screen output purposes
-    if (iterations % 500000 == 0) {
-      size_t start = 0;
-      if (reference.size() > 150) {
-        start = reference.size() - 150;
+    // Only look at the clock occasionally to keep bookkeeping cheap.
+    // Subspace searches leave this to whoever is coordinating them.
+    if (split == length and (iterations & 0xFFFF) == 0) {
+      auto now = std::chrono::steady_clock::now();
+      if (not checkpoint_file.empty()
+          and now - last_checkpoint >= checkpoint_interval) {
+        save_checkpoint(index, writer);
+        last_checkpoint = now;
+      }
+      if (now - last_report >= report_interval) {
+        report_progress(fraction_complete(), true);
+      }
+    }
+  }
+}
+
+void Enumeration::set_telemetry(const string& filename, double seconds) {
+  report_interval = std::chrono::duration<double>(seconds);
+  if (not filename.empty()) {
+    telemetry = std::make_shared<std::ofstream>(filename);
+  }
+}
+
+double Enumeration::fraction_complete() const {
+  // Treat "reference" as a mixed-radix number with position length - 1 as the most significant
+  double fraction = 0;
+  double scale = 1;
+  for (size_t i = length; i > 0; i--) {
+    scale /= upper[i - 1] - lower[i - 1] + 1;
+    fraction += (reference[i - 1] - lower[i - 1]) * scale;
+  }
+  return fraction;
+}
+
+void Enumeration::start_reporting(double fraction) {
+  start_time = std::chrono::steady_clock::now();
+  last_report = start_time;
+  last_report_iterations = iterations;
+  start_fraction = fraction;
+  skips.assign(length, 0);
+}
+
+void Enumeration::report_progress(double fraction, bool screen) {
+  auto now = std::chrono::steady_clock::now();
+  double elapsed = std::chrono::duration<double>(now - start_time).count();
+  double interval = std::chrono::duration<double>(now - last_report).count();
+  double rate = 0;
+  if (interval > 0) {
+    rate = (iterations - last_report_iterations) / interval;
+  }
+  // Assume the rest of the space passes at the same average speed
+  double eta = -1;
+  if (fraction > start_fraction) {
+    eta = (1 - fraction) * elapsed / (fraction - start_fraction);
+  }
+  if (screen) {
+    cout << "Progress: " << 100 * fraction << "% Iterations/s: " << rate
+         << " Found: " << count << " ETA seconds: " << eta << endl;
+  }
+  if (telemetry) {
+    auto & line = *telemetry;
+    line << "{\"seconds\": " << elapsed << ", \"iterations\": " << iterations
+         << ", \"iterations_per_second\": " << rate << ", \"stable_states\": "
+         << count << ", \"fraction\": " << fraction << ", \"eta_seconds\": ";
+    if (eta < 0) {
+      line << "null";
+    } else {
+      line << eta;
+    }
+    line << ", \"skips\": [";
+    for (size_t i = 0; i < skips.size(); i++) {
+      if (i) {
+        line << ", ";
+      }
+      line << skips[i];
+    }
+    line << "]}" << endl;
+  }
+  last_report = now;
+  last_report_iterations = iterations;
+}
+
+void Enumeration::enumerate(std::ostream& out) {
+  // start all variables at lower bound
+  reference.resize(length);
+  for (size_t i = 0; i < length; i++) {
+    reference[i] = lower[i];
+  }
+  rebuild_changes_needed();
+
+  StateWriter writer(model, out, format);
+  if (format == StateWriter::TEXT) {
+    model.print_header(out);
+  }
+
+  iterations = 0;
+  count = 0;
+  last_checkpoint = std::chrono::steady_clock::now();
+  start_reporting(0);
+  search(length, length - 1, writer);
+  writer.flush();
+  report_progress(1, false);
+  cout << endl;
+  if (format == StateWriter::TEXT) {
+    out << "# Count: " << count << endl;
+  }
+  cout << "Count: " << count << endl;
+  cout << "Iterations: " << iterations << endl;
+}
+
+vector<vector<int>> Enumeration::collect() {
+  reference.resize(length);
+  for (size_t i = 0; i < length; i++) {
+    reference[i] = lower[i];
+  }
+  rebuild_changes_needed();
+  vector<vector<int>> result;
+  // Nothing is written, the states are only stored
+  std::ostringstream unused;
+  StateWriter writer(model, unused, format);
+  bool was_count_only = count_only;
+  count_only = true;
+  collected = &result;
+  iterations = 0;
+  count = 0;
+  start_reporting(0);
+  search(length, length - 1, writer);
+  collected = nullptr;
+  count_only = was_count_only;
+  return result;
+}
+
+void Enumeration::set_checkpoint(const string& filename, double seconds) {
+  checkpoint_file = filename;
+  checkpoint_interval = std::chrono::duration<double>(seconds);
+}
+
+void Enumeration::save_checkpoint(size_t index, StateWriter& writer) {
+  // Everything before the offset must actually be in the file
+  writer.flush();
+  auto & out = writer.stream();
+  out.flush();
+  size_t offset = out.tellp();
+  // Write to a temporary file and then rename it over the old checkpoint so
+  // there is always a complete checkpoint on disk.
+  string temporary = checkpoint_file + ".tmp";
+  {
+    std::ofstream checkpoint(temporary);
+    checkpoint << "# Enumeration checkpoint: length index iterations count offset"
+               << endl;
+    checkpoint << length << " " << index << " " << iterations << " " << count
+               << " " << offset << endl;
+    for (const auto value : reference) {
+      checkpoint << value << " ";
+    }
+    checkpoint << endl << settings();
+    if (not checkpoint) {
+      throw std::invalid_argument("Unable to write checkpoint: " + temporary);
+    }
+  }
+  if (std::rename(temporary.c_str(), checkpoint_file.c_str()) != 0) {
+    throw std::invalid_argument("Unable to replace checkpoint: " + checkpoint_file);
+  }
+}
+
+string Enumeration::settings() const {
+  std::ostringstream result;
+  result << (format == StateWriter::BINARY ? "binary" : "text")
+         << (count_only ? " count-only" : "") << endl;
+  // Names in position order capture the variable ordering, and the sources
+  // of each variable catch any edit to the model's rules
+  for (size_t i = 0; i < length; i++) {
+    const auto & interaction = model.get_interactions()[i];
+    result << interaction.target_name << " " << lower[i] << " " << upper[i];
+    for (const auto activator : interaction.activators) {
+      result << " +" << activator;
+    }
+    for (const auto inhibitor : interaction.inhibitors) {
+      result << " -" << inhibitor;
+    }
+    result << endl;
+  }
+  return result.str();
+}
+
+size_t Enumeration::checkpoint_offset(const string& filename) const {
+  std::ifstream checkpoint(filename);
+  string line;
+  getline(checkpoint, line);
+  size_t stored_length, index, stored_iterations, stored_count, offset;
+  if (not (checkpoint >> stored_length >> index >> stored_iterations
+      >> stored_count >> offset)) {
+    throw std::invalid_argument("Unable to read checkpoint: " + filename);
+  }
+  // Skip the rest of the counters line and the reference
+  getline(checkpoint, line);
+  getline(checkpoint, line);
+  std::ostringstream stored;
+  stored << checkpoint.rdbuf();
+  if (stored_length != length or stored.str() != settings()) {
+    throw std::invalid_argument(
+        "Checkpoint " + filename
+            + " was saved with a different model, ordering, clamp or format");
+  }
+  return offset;
+}
+
+void Enumeration::resume(std::ostream& out, const string& filename) {
+  // Rejects checkpoints saved with different settings
+  checkpoint_offset(filename);
+  std::ifstream checkpoint(filename);
+  string line;
+  getline(checkpoint, line);
+  size_t stored_length, index, offset;
+  if (not (checkpoint >> stored_length >> index >> iterations >> count
+      >> offset)) {
+    throw std::invalid_argument("Unable to read checkpoint: " + filename);
+  }
+  if (stored_length != length or index >= length) {
+    throw std::invalid_argument("Checkpoint " + filename + " does not match this model");
+  }
+  reference.resize(length);
+  for (size_t i = 0; i < length; i++) {
+    if (not (checkpoint >> reference[i]) or reference[i] < lower[i]
+        or reference[i] > upper[i]) {
+      throw std::invalid_argument("Checkpoint " + filename + " does not match this model");
+    }
+  }
+  // Auxiliary counters are fully determined by the reference
+  rebuild_changes_needed();
+  cout << "Resuming after " << iterations << " iterations with " << count
+       << " found" << endl;
+
+  last_checkpoint = std::chrono::steady_clock::now();
+  start_reporting(fraction_complete());
+  StateWriter writer(model, out, format);
+  search(length, index, writer);
+  writer.flush();
+  report_progress(1, false);
+  cout << endl;
+  if (format == StateWriter::TEXT) {
+    out << "# Count: " << count << endl;
+  }
+  cout << "Count: " << count << endl;
+  cout << "Iterations: " << iterations << endl;
+}
+
+void Enumeration::enumerate(std::ostream& out, size_t threads) {
+  if (threads <= 1 or length == 0) {
+    enumerate(out);
+    return;
+  }
+  // Fix the highest positions until there are plenty of tasks per thread.
+  // Hyperplanes make subspace sizes very uneven, so many small tasks keep
+  // every worker busy until the end.
+  size_t split = length;
+  size_t tasks = 1;
+  while (split > 1 and tasks < 64 * threads) {
+    split--;
+    tasks *= upper[split] - lower[split] + 1;
+  }
+
+  if (format == StateWriter::TEXT) {
+    model.print_header(out);
+  }
+
+  // Results are written in task order, which matches the serial order
+  vector<string> results(tasks);
+  vector<char> finished(tasks, 0);
+  size_t next_output = 0;
+  size_t tasks_finished = 0;
+  count = 0;
+  iterations = 0;
+  start_reporting(0);
+  std::mutex output_lock;
+  std::atomic<size_t> next_task(0);
+
+  // Each worker has its own reference and change tracking, copied before any
+  // thread starts so no copy reads counters that finished tasks are updating
+  vector<Enumeration> locals(threads, *this);
+  for (auto & local : locals) {
+    local.checkpoint_file.clear();
+    local.telemetry.reset();
+    local.reference.resize(length);
+    local.count = 0;
+    local.iterations = 0;
+    std::fill(local.skips.begin(), local.skips.end(), 0);
+  }
+
+  auto worker = [&](Enumeration& local) {
+    std::ostringstream buffer;
+    StateWriter writer(model, buffer, format);
+    size_t task;
+    while ((task = next_task++) < tasks) {
+      // Decode the task number into the fixed high positions
+      size_t remainder = task;
+      for (size_t i = split; i < length; i++) {
+        int range = upper[i] - lower[i] + 1;
+        local.reference[i] = lower[i] + remainder % range;
+        remainder /= range;
       }
-      string magic = "-*#";
-      for (size_t i = start; i < reference.size(); i++) {
-        cout << magic[reference[i] + 1];
+      for (size_t i = 0; i < split; i++) {
+        local.reference[i] = lower[i];
+      }
+      local.rebuild_changes_needed();
+      local.count = 0;
+      local.iterations = 0;
+      local.search(split, length - 1, writer);
+      writer.flush();
+
+      std::lock_guard<std::mutex> lock(output_lock);
+      results[task] = buffer.str();
+      buffer.str("");
+      finished[task] = 1;
+      count += local.count;
+      iterations += local.iterations;
+      for (size_t i = 0; i < length; i++) {
+        skips[i] += local.skips[i];
+        local.skips[i] = 0;
+      }
+      // Every task covers the same amount of the space
+      tasks_finished++;
+      if (std::chrono::steady_clock::now() - last_report >= report_interval) {
+        report_progress(double(tasks_finished) / tasks, true);
+      }
+      // Write out everything that is ready and in order
+      while (next_output < tasks and finished[next_output]) {
+        out << results[next_output];
+        string().swap(results[next_output]);
+        next_output++;
       }
-      cout << endl;
     }
+  };
+
+  vector<std::thread> pool;
+  for (size_t t = 0; t < threads; t++) {
+    pool.emplace_back(worker, std::ref(locals[t]));
+  }
+  for (auto & thread : pool) {
+    thread.join();
+  }
+  report_progress(1, false);
+  cout << endl;
+  if (format == StateWriter::TEXT) {
+    out << "# Count: " << count << endl;
   }
+  cout << "Count: " << count << endl;
+  cout << "Iterations: " << iterations << endl;
 }
@@ -8,9 +8,11 @@
 #define ENUMERATION_H_
 
 #include "Model.h"
+#include "StateWriter.h"
 #include <ostream>
+#include <fstream>
 #include <chrono>
-#include <unordered_set>
+#include <memory>
 
 class Enumeration {
  public:
@@ -19,19 +21,63 @@ class Enumeration {
   // Perform the enumeration, writing all of the steady states
   // to the "out" stream.
   void enumerate(std::ostream& out);
+  // Performs the same enumeration using "threads" workers. The highest positions
+  // are fixed to create independent subspaces which are handed out to workers as they
+  // become idle. Output is identical to the single threaded version.
+  void enumerate(std::ostream& out, size_t threads);
+  // Every "seconds" the single threaded enumeration will atomically save its
+  // position to "filename", allowing it to be resumed if the process is killed.
+  void set_checkpoint(const string& filename, double seconds);
+  // Continue the single threaded enumeration saved in "filename". "out" must
+  // already be positioned at the checkpoint's output offset.
+  void resume(std::ostream& out, const string& filename);
+  // Reads how many bytes of output had been written when "filename" was saved.
+  // Throws if it was saved with a different model, ordering, clamps or format,
+  // so call this before discarding any output.
+  size_t checkpoint_offset(const string& filename) const;
+  // Selects how steady states are written. The binary format writes nothing but states.
+  void set_format(StateWriter::Format format_) {
+    format = format_;
+  }
+  // Only search states where "position" is between "low" and "high" (inclusive).
+  void clamp(size_t position, int low, int high);
+  // If set, steady states are counted but not written out
+  void set_count_only(bool count_only_) {
+    count_only = count_only_;
+  }
+  // Performs a quiet single threaded enumeration and returns every steady state found
+  vector<vector<int>> collect();
+  size_t get_iterations() const {
+    return iterations;
+  }
+  // Every "seconds" report progress to the screen and, if "filename" isn't empty,
+  // append a line of JSON describing the progress to "filename".
+  void set_telemetry(const string& filename, double seconds);
  protected:
   const Model& model;
   size_t length;
-  // affects_of[X] gives you the set of affected positions when
-  // "X" is changed
-  vector<std::unordered_set<size_t>> affects_of;
+  // Stores a position which must be rechecked when something it depends on changes
+  struct Affected {
+    size_t target;
+    size_t minimum_dependency;
+  };
+  // affects[affects_start[X]] up to affects[affects_start[X + 1]] are the
+  // positions affected when "X" is changed, sorted by minimum_dependency so
+  // updates to "index_needs_change" are grouped together.
+  vector<size_t> affects_start;
+  vector<Affected> affects;
 
   // The current settings for all variables
   vector<int> reference;
+  // The range each position is searched over, which starts as the
+  // interaction's bounds but can be narrowed by "clamp"
+  vector<int> lower;
+  vector<int> upper;
   // Modifies reference[index] to be "newstate" and updates auxiliary data structures.
   void make_move(size_t index, int newstate);
-  // Advance index as far as you can go without skipping a potential steady state
-  size_t increment(size_t index);
+  // Advance index as far as you can go without skipping a potential steady state.
+  // Carries stop once they reach "limit".
+  size_t increment(size_t index, size_t limit);
   // Tracks how many interactions with "index" as its minimum dependency
   // currently require a change
   vector<int> index_needs_change;
@@ -41,6 +87,44 @@ class Enumeration {
   int total_changes_needed;
 
   void rebuild_changes_needed();
+
+  // Counts how many states have been examined
+  size_t iterations;
+  // Counts how many steady states have been found
+  size_t count;
+  // Enumerates all states that match "reference" at and above position "split",
+  // starting from "reference" and moving down from "index".
+  void search(size_t split, size_t index, StateWriter& writer);
+  StateWriter::Format format;
+  bool count_only;
+  // If not null, every steady state found is also stored here
+  vector<vector<int>>* collected;
+
+  // Checkpoint configuration, where an empty filename disables checkpoints
+  string checkpoint_file;
+  std::chrono::duration<double> checkpoint_interval;
+  std::chrono::steady_clock::time_point last_checkpoint;
+  // Writes out everything needed to continue searching from "index"
+  void save_checkpoint(size_t index, StateWriter& writer);
+  // Describes the format, variable ordering, each variable's activators and
+  // inhibitors and the clamped ranges, which must not change between saving a
+  // checkpoint and resuming it
+  string settings() const;
+
+  // Progress reporting configuration and state
+  std::shared_ptr<std::ofstream> telemetry;
+  std::chrono::duration<double> report_interval;
+  std::chrono::steady_clock::time_point start_time, last_report;
+  size_t last_report_iterations;
+  double start_fraction;
+  // skips[X] counts how many times the search jumped directly to incrementing position X
+  vector<size_t> skips;
+  // Returns what fraction of the mixed-radix space comes before "reference"
+  double fraction_complete() const;
+  // Resets the progress tracking to start from now
+  void start_reporting(double fraction);
+  // Writes progress information to the telemetry file, and optionally the screen
+  void report_progress(double fraction, bool screen);
 };
 
 #endif /* ENUMERATION_H_ */
@@ -11,52 +11,161 @@ using std::invalid_argument;
 using std::to_string;
 #include <unordered_set>
 using std::unordered_set;
+#include <set>
+#include <queue>
+#include <chrono>
 #include <cassert>
 #include <sstream>
 using std::istringstream;
 #include <unordered_set>
 using std::unordered_set;
+#include <cstring>
+#include <cctype>
+#include <cstdlib>
+#include <cstdint>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+namespace {
+bool ends_with(const string& text, const string& suffix) {
+  return text.size() >= suffix.size()
+      and text.compare(text.size() - suffix.size(), suffix.size(), suffix) == 0;
+}
+
+// Identifies compiled model files
+const char magic[8] = { 'H', 'M', 'O', 'D', 'E', 'L', '3', 0 };
+// Followed by source_start, inhibitor_start, sources, lower_bounds,
+// upper_bounds, original_positions and each interaction's phase, all stored as 32 bit numbers,
+// then each name in position order and the ordering, each ending in a 0
+struct CompiledHeader {
+  char magic[8];
+  uint64_t source_size;
+  uint64_t source_hash;
+  uint64_t variables;
+  uint64_t sources;
+  uint64_t text_bytes;
+};
+
+// Describes which version of "source" a compiled model was built from using its size
+// and an FNV-1a hash of its contents, so any edit is noticed no matter when it happened
+void stamp(const string& source, CompiledHeader& header) {
+  std::ifstream in(source, std::ios::binary);
+  if (not in) {
+    throw invalid_argument("Unable to read model file: " + source);
+  }
+  uint64_t hash = 14695981039346656037ULL;
+  uint64_t size = 0;
+  char buffer[1 << 16];
+  while (in.read(buffer, sizeof(buffer)) or in.gcount() > 0) {
+    for (std::streamsize i = 0; i < in.gcount(); i++) {
+      hash ^= static_cast<unsigned char>(buffer[i]);
+      hash *= 1099511628211ULL;
+    }
+    size += in.gcount();
+  }
+  header.source_size = size;
+  header.source_hash = hash;
+}
+
+// Splits "text" into lines and whitespace separated words without copying
+struct Scanner {
+  Scanner(const string& text)
+      : next(text.data()),
+        end(text.data() + text.size()),
+        position(next),
+        line_end(next) {
+  }
+  // Moves to the next line, returning false if there are none left
+  bool next_line() {
+    if (next == end) {
+      return false;
+    }
+    position = next;
+    line_end = static_cast<const char*>(std::memchr(position, '\n', end - position));
+    if (line_end == nullptr) {
+      line_end = end;
+    }
+    next = line_end == end ? end : line_end + 1;
+    return true;
+  }
+  // Finds the next word on the current line, returning false if there are none left
+  bool next_word(const char*& word, size_t& length) {
+    while (position < line_end and std::isspace(static_cast<unsigned char>(*position))) {
+      position++;
+    }
+    if (position == line_end) {
+      return false;
+    }
+    word = position;
+    while (position < line_end and not std::isspace(static_cast<unsigned char>(*position))) {
+      position++;
+    }
+    length = position - word;
+    return true;
+  }
+  bool next_int(int& value) {
+    const char* word;
+    size_t length;
+    if (not next_word(word, length)) {
+      return false;
+    }
+    char* parsed;
+    value = std::strtol(word, &parsed, 10);
+    if (parsed != word + length) {
+      throw invalid_argument("Input file had bad number: " + string(word, length));
+    }
+    return true;
+  }
+  // Start of the line after this one
+  const char* next;
+  const char* end;
+  // Where the current line has been read up to, and where it ends
+  const char* position;
+  const char* line_end;
+};
+}
+
+const int Interaction::no_phase;
 
 int Interaction::get_direction_of_change(
     const vector<int>& current_states) const {
-  vector<int> activator_states;
   // TODO Currently this treats all values > 0 as activated and all values < 0 as inhibited
   // you should probably allow each variable to control that information.
-  for (const auto index : activators) {
-    activator_states.push_back(current_states[index]);
-  }
-  vector<int> inhibitor_states;
-  for (const auto index : inhibitors) {
-    inhibitor_states.push_back(current_states[index]);
-  }
   // Line 2 in Equation 2
   if (inhibitors.size() == 0) {
     if (activators.size() == 0) {
       // If you have neither activators or inhibitors, you just keep your state
       return current_states[target];
     }
-    return *std::max_element(activator_states.begin(), activator_states.end());
-
+    int active_aggregate = current_states[activators[0]];
+    for (const auto index : activators) {
+      active_aggregate = std::max(active_aggregate, current_states[index]);
+    }
+    return active_aggregate;
+  }
+  int inhibit_aggregate = current_states[inhibitors[0]];
+  for (const auto index : inhibitors) {
+    inhibit_aggregate = std::max(inhibit_aggregate, current_states[index]);
+  }
   // Line 3 in Equation 2
-  } else if (activators.size() == 0) {
-    auto result = *std::max_element(inhibitor_states.begin(),
-                                    inhibitor_states.end());
+  if (activators.size() == 0) {
     // Perform negation
-    return -result;
+    return -inhibit_aggregate;
+  }
   // Line 1 in Equation 2
+  int active_aggregate = current_states[activators[0]];
+  for (const auto index : activators) {
+    active_aggregate = std::max(active_aggregate, current_states[index]);
+  }
+  // Activated is > 0
+  if (active_aggregate > 0 and inhibit_aggregate <= 0) {
+    return active_aggregate;
+  } else if (inhibit_aggregate > 0 and active_aggregate <= 0) {
+    return -inhibit_aggregate;
   } else {
-    auto active_aggregate = *std::max_element(activator_states.begin(),
-                                              activator_states.end());
-    auto inhibit_aggregate = *std::max_element(inhibitor_states.begin(),
-                                               inhibitor_states.end());
-    // Activated is > 0
-    if (active_aggregate > 0 and inhibit_aggregate <= 0) {
-      return active_aggregate;
-    } else if (inhibit_aggregate > 0 and active_aggregate <= 0) {
-      return -inhibit_aggregate;
-    } else {
-      return 0;
-    }
+    return 0;
   }
 }
 
@@ -87,9 +196,9 @@ int Interaction::get_next_state(const vector<int>& current_states) const {
 
 vector<int> Model::get_sync_next(const vector<int>& current_states) const {
   vector<int> result(current_states);
-  for (const auto & interaction : interactions) {
+  for (size_t i = 0; i < interactions.size(); i++) {
     // Determine how this interaction wants to change
-    result[interaction.target] = interaction.get_next_state(current_states);
+    result[i] = get_next_state(i, current_states);
   }
   return result;
 }
@@ -97,60 +206,24 @@ vector<int> Model::get_sync_next(const vector<int>& current_states) const {
 vector<vector<int>> Model::get_async_next_states(
     const vector<int>& current_states) const {
   vector<vector<int>> result;
-  for (const auto & interaction : interactions) {
-    int next_state = interaction.get_next_state(current_states);
-    // If a change is desired, create a new option where only "target" is changed.
-    if (next_state != current_states[interaction.target]) {
-      result.push_back(current_states);
-      result.back()[interaction.target] = next_state;
-    }
-  }
+  for_each_async_change(current_states, [&](size_t position, int value) {
+    // Create a new option where only "position" is changed.
+    result.push_back(current_states);
+    result.back()[position] = value;
+  });
   return result;
 }
 
 vector<vector<int>> Model::get_clock_next_states(
     const vector<int>& current_states) const {
-  // This is the brain
-  const unordered_set<string> brain = { "LH/FSH", "ACTH", "GnRH", "CRH" };
-  // TODO This should probably be moved out of this function and made a part of model
-  // Find the CLOCK
-  size_t clock = interactions.size();
-  bool brain_phase = false;
-  for (const auto& interaction : interactions) {
-    if (interaction.target_name == "CLOCK") {
-      clock = interaction.target;
-      brain_phase = current_states[clock] > 0;
-    }
-  }
-  assert(clock < interactions.size());
-  vector<vector<int>> result;
-  bool off_phase_update = false;
-  for (const auto & interaction : interactions) {
-    if (interaction.target_name == "CLOCK") {
-      // If this is the clock, skip it
-      continue;
-    }
-    // Determine if this is a brain interaction or not
-    bool is_brain = brain.count(interaction.target_name) == 1;
-    int next_state = interaction.get_next_state(current_states);
-
-    if (next_state != current_states[interaction.target]) {
-      if (brain_phase == is_brain) {
-        // If this update is "on phase", create the resulting state
-        result.push_back(current_states);
-        result.back()[interaction.target] = next_state;
-      } else {
-        // This update is "off phase", e.g. its currently blood's turn
-        // but the brain wants to update.
-        off_phase_update = true;
-      }
-    }
+  if (not has_clock()) {
+    throw invalid_argument("Clock updates require a CLOCK variable and PHASE lines");
   }
-  if (off_phase_update and result.size() == 0) {
-    // Advance the clock because we know eventually there will be an update
+  vector<vector<int>> result;
+  for_each_clock_change(current_states, [&](size_t position, int value) {
     result.push_back(current_states);
-    result.back()[clock] = not brain_phase;
-  }
+    result.back()[position] = value;
+  });
   return result;
 }
 
@@ -166,14 +239,82 @@ vector<int> Model::random_states(Random& random) const {
   return result;
 }
 
-Model::Model(string filename) {
-  if (filename.substr(filename.size() - 3, 3) == "csv") {
-    std::cout << "Loading CSV" << endl;
-    load_csv(filename);
+Model::Model(string filename, string ordering, string cache) {
+  if (ends_with(filename, ".hmodel")) {
+    if (not load_compiled(filename, "", "")) {
+      throw invalid_argument("Unable to read compiled model: " + filename);
+    }
+  } else if (cache != "" and load_compiled(cache, filename, ordering)) {
+    std::cout << "Loaded compiled model from " << cache << endl;
   } else {
-    load_post_format(filename);
+    if (ends_with(filename, "csv")) {
+      std::cout << "Loading CSV" << endl;
+      load_csv(filename);
+    } else if (ends_with(filename, ".edges")) {
+      load_edge_list(filename);
+    } else {
+      load_post_format(filename);
+    }
+    auto start = std::chrono::steady_clock::now();
+    setup(ordering);
+    std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+    std::cout << "Ordering " << ordering << " took " << seconds.count()
+              << " seconds" << endl;
+    if (cache != "") {
+      save_compiled(cache, filename, ordering);
+    }
+  }
+
+  std::cout << "Unique names: " << name_to_position.size() << " interactions: "
+            << interactions.size() << std::endl;
+}
+
+Model::Model(const Model& parent, const vector<string>& names,
+             const string ordering) {
+  for (const auto & name : names) {
+    size_t position = parent.find_position(name);
+    if (position >= parent.size()) {
+      throw invalid_argument("Sub-model uses unknown variable: " + name);
+    }
+    // Only the names are kept, positions are assigned by "setup"
+    Interaction interaction = parent.interactions[position];
+    interaction.activators.clear();
+    interaction.inhibitors.clear();
+    interactions.push_back(interaction);
   }
+  setup(ordering);
+}
 
+vector<vector<string>> Model::components() const {
+  auto graph = variable_graph();
+  // Label each position with the first column (in input order) of its component
+  vector<size_t> label(size(), size());
+  vector<vector<string>> result;
+  for (const auto & name : original_ordering) {
+    size_t start = name_to_position.at(name);
+    if (label[start] < size()) {
+      result[label[start]].push_back(name);
+      continue;
+    }
+    label[start] = result.size();
+    result.push_back( { name });
+    // Depth first search to label everything else in this component
+    vector<size_t> stack = { start };
+    while (not stack.empty()) {
+      size_t current = stack.back();
+      stack.pop_back();
+      for (const auto neighbor : graph[current]) {
+        if (label[neighbor] == size()) {
+          label[neighbor] = label[start];
+          stack.push_back(neighbor);
+        }
+      }
+    }
+  }
+  return result;
+}
+
+void Model::setup(const string& ordering) {
   position_to_name.resize(interactions.size());
   original_ordering.resize(interactions.size());
 
@@ -182,31 +323,37 @@ Model::Model(string filename) {
     auto name = interactions[i].target_name;
     original_ordering[i] = name;
   }
-  // Change the ordering to make everything better for enumeration
-  reorganize();
-
-  // Set up the numeric positions of "target", "activators", "inhibitors", and "minimum_dependency"
-  for (auto & interaction : interactions) {
-    interaction.target = name_to_position[interaction.target_name];
-    size_t min_dep = interaction.target;
-    for (const auto name : interaction.activator_names) {
-      auto result = name_to_position.find(name);
-      if (result == name_to_position.end()) {
+  // Every name has to have its own interaction before positions can be assigned
+  unordered_set<string> targets(original_ordering.begin(), original_ordering.end());
+  for (const auto & interaction : interactions) {
+    for (const auto & name : interaction.activator_names) {
+      if (targets.count(name) == 0) {
         throw invalid_argument(
             "Input file had " + interaction.target_name + " have activator "
                 + name + " that has no line of its own.");
       }
-      interaction.activators.push_back(result->second);
-      min_dep = std::min(min_dep, interaction.activators.back());
     }
-    for (const auto name : interaction.inhibitor_names) {
-      auto result = name_to_position.find(name);
-      if (result == name_to_position.end()) {
+    for (const auto & name : interaction.inhibitor_names) {
+      if (targets.count(name) == 0) {
         throw invalid_argument(
             "Input file had " + interaction.target_name + " have inhibitor "
                 + name + " that has no line of its own.");
       }
-      interaction.inhibitors.push_back(result->second);
+    }
+  }
+  // Change the ordering to make everything better for enumeration
+  reorganize(ordering);
+
+  // Set up the numeric positions of "target", "activators", "inhibitors", and "minimum_dependency"
+  for (auto & interaction : interactions) {
+    interaction.target = name_to_position[interaction.target_name];
+    size_t min_dep = interaction.target;
+    for (const auto & name : interaction.activator_names) {
+      interaction.activators.push_back(name_to_position[name]);
+      min_dep = std::min(min_dep, interaction.activators.back());
+    }
+    for (const auto & name : interaction.inhibitor_names) {
+      interaction.inhibitors.push_back(name_to_position[name]);
       min_dep = std::min(min_dep, interaction.inhibitors.back());
     }
     interaction.minimum_dependency = min_dep;
@@ -221,44 +368,82 @@ Model::Model(string filename) {
       index++;
     }
   }
+  compile();
+  for (const auto & name : original_ordering) {
+    original_positions.push_back(name_to_position[name]);
+  }
+}
 
-  std::cout << "Unique names: " << name_to_position.size() << " interactions: "
-            << interactions.size() << std::endl;
+void Model::compile() {
+  sources.clear();
+  source_start.clear();
+  inhibitor_start.clear();
+  lower_bounds.clear();
+  upper_bounds.clear();
+  for (const auto & interaction : interactions) {
+    source_start.push_back(sources.size());
+    sources.insert(sources.end(), interaction.activators.begin(),
+                   interaction.activators.end());
+    inhibitor_start.push_back(sources.size());
+    sources.insert(sources.end(), interaction.inhibitors.begin(),
+                   interaction.inhibitors.end());
+    lower_bounds.push_back(interaction.lower_bound);
+    upper_bounds.push_back(interaction.upper_bound);
+  }
+  // Sentinel so source_start[i + 1] is always valid
+  source_start.push_back(sources.size());
+  // Anything without a phase updates while the clock is at its lowest value
+  clock = find_position("CLOCK");
+  phased = false;
+  phases.clear();
+  for (const auto & interaction : interactions) {
+    phased |= interaction.phase != Interaction::no_phase;
+    if (interaction.phase != Interaction::no_phase or clock >= size()) {
+      phases.push_back(interaction.phase);
+    } else {
+      phases.push_back(lower_bounds[clock]);
+    }
+  }
 }
 
 void Model::load_post_format(const string filename) {
-  std::ifstream input(filename);
-  string line;
-  string word;
+  // Read the whole file at once and split it in place
+  std::ifstream input(filename, std::ios::binary);
+  if (not input) {
+    throw invalid_argument("Unable to read model file: " + filename);
+  }
+  input.seekg(0, std::ios::end);
+  string text(size_t(input.tellg()), 0);
+  input.seekg(0);
+  input.read(&text[0], text.size());
+  Scanner scanner(text);
+  const char* word;
+  size_t length;
   int value;
   unordered_set<string> unique_test_names;
   // Read the top line to find all of the names
-  getline(input, line);
+  scanner.next_line();
   vector<string> header_names;
-  std::istringstream iss(line);
-  while (iss >> word) {
-    header_names.push_back(word);
-    auto result = unique_test_names.insert(word);
+  while (scanner.next_word(word, length)) {
+    header_names.emplace_back(word, length);
+    auto result = unique_test_names.insert(header_names.back());
     if (not result.second) {
-      throw invalid_argument("Input file header duplicates symbol: '" + word + "'");
+      throw invalid_argument(
+          "Input file header duplicates symbol: '" + header_names.back() + "'");
     }
   }
 
   // Read the second line to get the range of each variable
-  getline(input, line);
+  scanner.next_line();
   vector<int> settings;
-  iss.clear();
-  iss.str(line);
-  while (iss >> value) {
+  while (scanner.next_int(value)) {
     settings.push_back(value);
   }
 
   // Read the third line to get the minimum value of each variable
-  getline(input, line);
-  iss.clear();
-  iss.str(line);
+  scanner.next_line();
   vector<int> minimums;
-  while (iss >> value) {
+  while (scanner.next_int(value)) {
     minimums.push_back(value);
   }
   if (header_names.size() != settings.size()) {
@@ -267,46 +452,352 @@ void Model::load_post_format(const string filename) {
   if (settings.size() != minimums.size()) {
     throw invalid_argument("Input file had mismatched ranges and minimums");
   }
+  interactions.reserve(header_names.size());
+  vector<std::pair<string, int>> named_phases;
   size_t index = 0;
   // For the rest of the lines
-  while (getline(input, line)) {
-    std::istringstream iss(line);
-    Interaction interaction;
-    iss >> interaction.target_name;
-    if (interaction.target_name == "") {
+  while (scanner.next_line()) {
+    if (not scanner.next_word(word, length)) {
       // Skip blank lines
       continue;
     }
+    if (string(word, length) == "PHASE") {
+      // Unless this is a variable named PHASE, the line gives a clock phase
+      const char* row = scanner.position;
+      int value;
+      if (scanner.next_word(word, length) and string(word, length) != "=") {
+        scanner.position = row;
+        scanner.next_int(value);
+        while (scanner.next_word(word, length)) {
+          named_phases.emplace_back(string(word, length), value);
+        }
+        continue;
+      }
+      scanner.position = row;
+      word = "PHASE";
+      length = 5;
+    }
     if (index >= header_names.size()) {
       throw invalid_argument(
           "Input file had more rows than names in the header/ranges for variables");
     }
-    if (interaction.target_name != header_names[index]) {
+    if (header_names[index].compare(0, string::npos, word, length) != 0) {
       throw invalid_argument(
           "Input file had rows in a different order than header names");
     }
+    Interaction interaction;
+    interaction.target_name = header_names[index];
     // ignore the =
-    iss >> word;
-    if (word != "=") {
+    if (not scanner.next_word(word, length) or string(word, length) != "=") {
       throw invalid_argument("Input file missing = after interaction name");
     }
-    string behavior;
-    while (iss >> word >> behavior) {
-      if (behavior == "PROMOTES") {
-        interaction.activator_names.push_back(word);
-      } else if (behavior == "INHIBITS") {
-        interaction.inhibitor_names.push_back(word);
+    const char* behavior;
+    size_t behavior_length;
+    while (scanner.next_word(word, length)
+        and scanner.next_word(behavior, behavior_length)) {
+      string kind(behavior, behavior_length);
+      if (kind == "PROMOTES") {
+        interaction.activator_names.emplace_back(word, length);
+      } else if (kind == "INHIBITS") {
+        interaction.inhibitor_names.emplace_back(word, length);
       } else {
         throw invalid_argument(
             "Input file bad behavior for " + interaction.target_name + " of "
-                + behavior);
+                + kind);
       }
     }
     interaction.lower_bound = minimums[index];
     interaction.upper_bound = minimums[index] + settings[index] - 1;
-    interactions.push_back(interaction);
+    interactions.push_back(std::move(interaction));
     index++;
   }
+  assign_phases(named_phases);
+}
+
+void Model::load_edge_list(const string filename) {
+  std::ifstream input(filename);
+  if (not input) {
+    throw invalid_argument("Unable to read model file: " + filename);
+  }
+  // Where each name's interaction is, and if it has had its node line yet
+  unordered_map<string, size_t> index;
+  vector<bool> declared;
+  auto lookup = [&](const string& name) -> Interaction& {
+    auto result = index.insert( { name, interactions.size() });
+    if (result.second) {
+      interactions.emplace_back();
+      interactions.back().target_name = name;
+      declared.push_back(false);
+    }
+    return interactions[result.first->second];
+  };
+  vector<std::pair<string, int>> named_phases;
+  string line;
+  const char* word;
+  size_t length;
+  size_t line_number = 0;
+  while (getline(input, line)) {
+    line_number++;
+    line = line.substr(0, line.find('#'));
+    Scanner scanner(line);
+    if (not scanner.next_line() or not scanner.next_word(word, length)) {
+      continue;
+    }
+    string kind(word, length);
+    vector<string> fields;
+    while (scanner.next_word(word, length)) {
+      fields.emplace_back(word, length);
+    }
+    const string where = " on line " + to_string(line_number) + " of " + filename;
+    if (kind == "phase" and fields.size() >= 2) {
+      char* parsed;
+      int value = std::strtol(fields[0].c_str(), &parsed, 10);
+      if (*parsed != 0) {
+        throw invalid_argument("Edge list had bad number: " + fields[0] + where);
+      }
+      for (size_t i = 1; i < fields.size(); i++) {
+        named_phases.emplace_back(fields[i], value);
+      }
+      continue;
+    }
+    if (fields.size() != 3 or (kind != "node" and kind != "edge")) {
+      throw invalid_argument(
+          "Edge list expects node or edge and 3 values, or phase and names" + where);
+    }
+    auto number = [&](const string& field) {
+      char* parsed;
+      int value = std::strtol(field.c_str(), &parsed, 10);
+      if (field.empty() or *parsed != 0) {
+        throw invalid_argument("Edge list had bad number: " + field + where);
+      }
+      return value;
+    };
+    auto & interaction = lookup(fields[0]);
+    if (kind == "node") {
+      size_t position = index[fields[0]];
+      if (declared[position]) {
+        throw invalid_argument("Edge list declares " + fields[0] + " twice" + where);
+      }
+      declared[position] = true;
+      int range = number(fields[1]);
+      if (range < 1) {
+        throw invalid_argument("Edge list has a range below 1" + where);
+      }
+      interaction.lower_bound = number(fields[2]);
+      interaction.upper_bound = interaction.lower_bound + range - 1;
+    } else if (fields[2] == "+" or fields[2] == "1") {
+      interaction.activator_names.push_back(fields[1]);
+    } else if (fields[2] == "-" or fields[2] == "-1") {
+      interaction.inhibitor_names.push_back(fields[1]);
+    } else {
+      throw invalid_argument("Edge list has unknown sign " + fields[2] + where);
+    }
+  }
+  for (size_t i = 0; i < interactions.size(); i++) {
+    if (not declared[i]) {
+      throw invalid_argument(
+          "Edge list has edges into " + interactions[i].target_name
+              + " but no node line for it");
+    }
+  }
+  assign_phases(named_phases);
+}
+
+void Model::assign_phases(const vector<std::pair<string, int>>& named_phases) {
+  if (named_phases.empty()) {
+    return;
+  }
+  unordered_map<string, size_t> index;
+  for (size_t i = 0; i < interactions.size(); i++) {
+    index[interactions[i].target_name] = i;
+  }
+  auto clock = index.find("CLOCK");
+  if (clock == index.end()) {
+    throw invalid_argument("Input file has phases but no CLOCK");
+  }
+  const auto & clock_interaction = interactions[clock->second];
+  for (const auto & named_phase : named_phases) {
+    auto found = index.find(named_phase.first);
+    if (found == index.end()) {
+      throw invalid_argument(
+          "Input file gives a phase to unknown variable " + named_phase.first);
+    }
+    auto & interaction = interactions[found->second];
+    if (interaction.phase != Interaction::no_phase) {
+      throw invalid_argument(
+          "Input file gives " + named_phase.first + " more than one phase");
+    }
+    if (named_phase.second < clock_interaction.lower_bound
+        or named_phase.second > clock_interaction.upper_bound) {
+      throw invalid_argument(
+          "Input file gives " + named_phase.first + " a phase CLOCK never reaches");
+    }
+    interaction.phase = named_phase.second;
+  }
+}
+
+bool Model::load_compiled(const string& filename, const string& source,
+                          const string& ordering) {
+  int file = open(filename.c_str(), O_RDONLY);
+  if (file < 0) {
+    return false;
+  }
+  struct stat info;
+  if (fstat(file, &info) != 0 or size_t(info.st_size) < sizeof(CompiledHeader)) {
+    close(file);
+    return false;
+  }
+  size_t file_size = info.st_size;
+  void* region = mmap(nullptr, file_size, PROT_READ, MAP_PRIVATE, file, 0);
+  close(file);
+  if (region == MAP_FAILED) {
+    return false;
+  }
+  const char* data = static_cast<const char*>(region);
+  CompiledHeader header;
+  std::memcpy(&header, data, sizeof(header));
+  const size_t n = header.variables;
+  const size_t m = header.sources;
+  const size_t numbers = (n + 1) + n + m + 4 * n;
+  bool valid = std::memcmp(header.magic, magic, sizeof(magic)) == 0
+      and n < (file_size / sizeof(uint32_t)) and m < (file_size / sizeof(uint32_t))
+      and sizeof(header) + numbers * sizeof(uint32_t) + header.text_bytes == file_size;
+  if (valid and source != "") {
+    CompiledHeader expected;
+    stamp(source, expected);
+    valid = header.source_size == expected.source_size
+        and header.source_hash == expected.source_hash;
+  }
+  vector<uint32_t> number(valid ? numbers : 0);
+  vector<string> text;
+  if (valid) {
+    const char* position = data + sizeof(header);
+    std::memcpy(number.data(), position, numbers * sizeof(uint32_t));
+    position += numbers * sizeof(uint32_t);
+    const char* end = data + file_size;
+    while (position < end) {
+      const char* stop = static_cast<const char*>(std::memchr(position, 0, end - position));
+      if (stop == nullptr) {
+        break;
+      }
+      text.emplace_back(position, stop);
+      position = stop + 1;
+    }
+    valid = text.size() == n + 1 and (source == "" or text.back() == ordering);
+  }
+  munmap(region, file_size);
+  if (not valid) {
+    return false;
+  }
+  const uint32_t* starts = number.data();
+  const uint32_t* inhibitor_starts = starts + n + 1;
+  const uint32_t* source_positions = inhibitor_starts + n;
+  const uint32_t* lowers = source_positions + m;
+  const uint32_t* uppers = lowers + n;
+  const uint32_t* originals = uppers + n;
+  const uint32_t* interaction_phases = originals + n;
+  // Everything has to point inside the model before it can be trusted
+  if (starts[0] != 0 or starts[n] != m) {
+    return false;
+  }
+  // Every column must appear exactly once, and every range must be non empty
+  // with a size that fits in an int
+  vector<char> column_used(n, 0);
+  for (size_t i = 0; i < n; i++) {
+    int64_t range = int64_t(int32_t(uppers[i])) - int32_t(lowers[i]);
+    if (starts[i] > inhibitor_starts[i] or inhibitor_starts[i] > starts[i + 1]
+        or originals[i] >= n or column_used[originals[i]]
+        or range < 0 or range >= std::numeric_limits<int32_t>::max()) {
+      return false;
+    }
+    column_used[originals[i]] = 1;
+  }
+  for (size_t i = 0; i < m; i++) {
+    if (source_positions[i] >= n) {
+      return false;
+    }
+  }
+  unordered_map<string, size_t> names;
+  for (size_t position = 0; position < n; position++) {
+    if (not names.insert( { text[position], position }).second) {
+      return false;
+    }
+  }
+  // Phases have to be values "CLOCK" can take, the same as "assign_phases" requires
+  auto clock_found = names.find("CLOCK");
+  for (size_t position = 0; position < n; position++) {
+    int phase = int32_t(interaction_phases[position]);
+    if (phase != Interaction::no_phase
+        and (clock_found == names.end()
+            or phase < int32_t(lowers[clock_found->second])
+            or phase > int32_t(uppers[clock_found->second]))) {
+      return false;
+    }
+  }
+  interactions.assign(n, Interaction());
+  position_to_name.assign(text.begin(), text.end() - 1);
+  name_to_position.swap(names);
+  for (size_t position = 0; position < n; position++) {
+    auto & interaction = interactions[position];
+    interaction.target = position;
+    interaction.target_name = position_to_name[position];
+    interaction.lower_bound = int32_t(lowers[position]);
+    interaction.upper_bound = int32_t(uppers[position]);
+    interaction.minimum_dependency = position;
+    interaction.phase = int32_t(interaction_phases[position]);
+    for (size_t i = starts[position]; i < starts[position + 1]; i++) {
+      size_t from = source_positions[i];
+      if (i < inhibitor_starts[position]) {
+        interaction.activators.push_back(from);
+        interaction.activator_names.push_back(position_to_name[from]);
+      } else {
+        interaction.inhibitors.push_back(from);
+        interaction.inhibitor_names.push_back(position_to_name[from]);
+      }
+      interaction.minimum_dependency = std::min(interaction.minimum_dependency, from);
+    }
+  }
+  original_positions.assign(originals, originals + n);
+  original_ordering.clear();
+  for (const auto position : original_positions) {
+    original_ordering.push_back(position_to_name[position]);
+  }
+  compile();
+  return true;
+}
+
+void Model::save_compiled(const string& filename, const string& source,
+                          const string& ordering) const {
+  CompiledHeader header;
+  std::memcpy(header.magic, magic, sizeof(magic));
+  stamp(source, header);
+  header.variables = size();
+  header.sources = sources.size();
+  string text;
+  for (const auto & name : position_to_name) {
+    text.append(name);
+    text.push_back(0);
+  }
+  text.append(ordering);
+  text.push_back(0);
+  header.text_bytes = text.size();
+  vector<uint32_t> number(source_start.begin(), source_start.end());
+  number.insert(number.end(), inhibitor_start.begin(), inhibitor_start.end());
+  number.insert(number.end(), sources.begin(), sources.end());
+  number.insert(number.end(), lower_bounds.begin(), lower_bounds.end());
+  number.insert(number.end(), upper_bounds.begin(), upper_bounds.end());
+  number.insert(number.end(), original_positions.begin(), original_positions.end());
+  for (const auto & interaction : interactions) {
+    number.push_back(interaction.phase);
+  }
+  std::ofstream out(filename, std::ios::binary);
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(number.data()),
+            number.size() * sizeof(uint32_t));
+  out.write(text.data(), text.size());
+  if (not out) {
+    throw invalid_argument("Unable to write compiled model: " + filename);
+  }
 }
 
 void Model::load_csv(const string filename) {
@@ -352,7 +843,244 @@ void Model::load_csv(const string filename) {
   }
 }
 
-void Model::reorganize() {
+bool Model::known_ordering(const string& ordering) {
+  return ordering == "greedy" or ordering == "deterministic"
+      or ordering == "min-degree" or ordering == "min-fill"
+      or ordering == "cuthill-mckee";
+}
+
+void Model::reorganize(const string& ordering) {
+  if (ordering == "greedy") {
+    reorganize_greedy();
+    return;
+  } else if (ordering == "deterministic") {
+    reorganize_queue();
+    return;
+  }
+  vector<size_t> order;
+  if (ordering == "min-degree" or ordering == "min-fill") {
+    order = elimination_order(ordering == "min-fill");
+    // Variables eliminated last are the most connected, so they go on top
+    std::reverse(order.begin(), order.end());
+  } else if (ordering == "cuthill-mckee") {
+    order = cuthill_mckee_order();
+  } else {
+    throw invalid_argument("Unknown variable ordering: " + ordering);
+  }
+  // The first variable in the order gets the highest position
+  position_to_name.assign(interactions.size(), "");
+  for (size_t i = 0; i < order.size(); i++) {
+    size_t position = interactions.size() - 1 - i;
+    const string & name = interactions[order[i]].target_name;
+    name_to_position[name] = position;
+    position_to_name[position] = name;
+  }
+}
+
+vector<vector<size_t>> Model::variable_graph() const {
+  unordered_map<string, size_t> name_to_index;
+  for (size_t i = 0; i < interactions.size(); i++) {
+    name_to_index[interactions[i].target_name] = i;
+  }
+  vector<vector<size_t>> graph(interactions.size());
+  for (size_t i = 0; i < interactions.size(); i++) {
+    for (const auto & names : { interactions[i].activator_names,
+        interactions[i].inhibitor_names }) {
+      for (const auto & name : names) {
+        auto result = name_to_index.find(name);
+        if (result == name_to_index.end()) {
+          throw invalid_argument(
+              "Input file had " + interactions[i].target_name + " depend on "
+                  + name + " that has no line of its own.");
+        }
+        if (result->second != i) {
+          graph[i].push_back(result->second);
+          graph[result->second].push_back(i);
+        }
+      }
+    }
+  }
+  for (auto & neighbors : graph) {
+    std::sort(neighbors.begin(), neighbors.end());
+    neighbors.erase(std::unique(neighbors.begin(), neighbors.end()),
+                    neighbors.end());
+  }
+  return graph;
+}
+
+vector<size_t> Model::elimination_order(bool minimize_fill) const {
+  auto initial = variable_graph();
+  vector<std::set<size_t>> graph;
+  for (const auto & neighbors : initial) {
+    graph.emplace_back(neighbors.begin(), neighbors.end());
+  }
+  vector<bool> removed(graph.size(), false);
+  vector<size_t> order;
+  while (order.size() < graph.size()) {
+    // Find the best variable, breaking ties by input order
+    size_t best = graph.size();
+    size_t best_score = 0;
+    for (size_t v = 0; v < graph.size(); v++) {
+      if (removed[v]) {
+        continue;
+      }
+      size_t score = graph[v].size();
+      if (minimize_fill) {
+        // Count how many neighbor pairs are not already connected
+        score = 0;
+        for (auto a = graph[v].begin(); a != graph[v].end(); a++) {
+          for (auto b = std::next(a); b != graph[v].end(); b++) {
+            score += graph[*a].count(*b) == 0;
+          }
+        }
+      }
+      if (best == graph.size() or score < best_score) {
+        best = v;
+        best_score = score;
+      }
+    }
+    // Connect all of its neighbors together and remove it
+    for (const auto a : graph[best]) {
+      graph[a].erase(best);
+      for (const auto b : graph[best]) {
+        if (a != b) {
+          graph[a].insert(b);
+        }
+      }
+    }
+    graph[best].clear();
+    removed[best] = true;
+    order.push_back(best);
+  }
+  return order;
+}
+
+vector<size_t> Model::cuthill_mckee_order() const {
+  auto graph = variable_graph();
+  vector<bool> visited(graph.size(), false);
+  vector<size_t> order;
+  auto by_degree = [&graph](size_t a, size_t b) {
+    return graph[a].size() < graph[b].size() or
+        (graph[a].size() == graph[b].size() and a < b);
+  };
+  while (order.size() < graph.size()) {
+    // Start each component from its lowest degree variable
+    size_t start = graph.size();
+    for (size_t v = 0; v < graph.size(); v++) {
+      if (not visited[v] and (start == graph.size() or by_degree(v, start))) {
+        start = v;
+      }
+    }
+    // Breadth first search, visiting neighbors in order of increasing degree
+    visited[start] = true;
+    size_t head = order.size();
+    order.push_back(start);
+    while (head < order.size()) {
+      vector<size_t> next;
+      for (const auto neighbor : graph[order[head]]) {
+        if (not visited[neighbor]) {
+          visited[neighbor] = true;
+          next.push_back(neighbor);
+        }
+      }
+      std::sort(next.begin(), next.end(), by_degree);
+      order.insert(order.end(), next.begin(), next.end());
+      head++;
+    }
+  }
+  // Reversing the order tends to reduce fill
+  std::reverse(order.begin(), order.end());
+  return order;
+}
+
+void Model::reorganize_queue() {
+  const size_t n = interactions.size();
+  const size_t unassigned = -1;
+  unordered_map<string, size_t> id;
+  id.reserve(n);
+  for (size_t i = 0; i < n; i++) {
+    id[interactions[i].target_name] = i;
+  }
+  // names[name_start[i]] up to names[name_start[i + 1]] are the variables used by
+  // interaction "i", itself first and then its sources in input order, without repeats
+  vector<size_t> names;
+  vector<size_t> name_start = { 0 };
+  vector<size_t> last_used(n, unassigned);
+  for (size_t i = 0; i < n; i++) {
+    auto add = [&](size_t variable) {
+      if (last_used[variable] != i) {
+        last_used[variable] = i;
+        names.push_back(variable);
+      }
+    };
+    add(i);
+    for (const auto & name : interactions[i].activator_names) {
+      add(id.at(name));
+    }
+    for (const auto & name : interactions[i].inhibitor_names) {
+      add(id.at(name));
+    }
+    name_start.push_back(names.size());
+  }
+  // users[user_start[v]] up to users[user_start[v + 1]] are the interactions using "v"
+  vector<size_t> user_start(n + 1, 0);
+  for (const auto variable : names) {
+    user_start[variable + 1]++;
+  }
+  for (size_t v = 0; v < n; v++) {
+    user_start[v + 1] += user_start[v];
+  }
+  vector<size_t> users(names.size());
+  vector<size_t> filled(user_start.begin(), user_start.end() - 1);
+  for (size_t i = 0; i < n; i++) {
+    for (size_t k = name_start[i]; k < name_start[i + 1]; k++) {
+      users[filled[names[k]]++] = i;
+    }
+  }
+  // Always take the interaction with the fewest unassigned names, breaking ties by
+  // input order. Counts only go down, so outdated queue entries are skipped when popped.
+  vector<size_t> remaining(n);
+  vector<bool> done(n, false);
+  typedef std::pair<size_t, size_t> Entry;
+  std::priority_queue<Entry, vector<Entry>, std::greater<Entry>> queue;
+  for (size_t i = 0; i < n; i++) {
+    remaining[i] = name_start[i + 1] - name_start[i];
+    queue.emplace(remaining[i], i);
+  }
+  vector<size_t> position(n, unassigned);
+  size_t highest_available = n;
+  while (highest_available > 0 and not queue.empty()) {
+    auto top = queue.top();
+    queue.pop();
+    size_t i = top.second;
+    if (done[i] or top.first != remaining[i]) {
+      continue;
+    }
+    done[i] = true;
+    // Assign all names used by interaction[i] to the highest remaining positions
+    for (size_t k = name_start[i]; k < name_start[i + 1]; k++) {
+      size_t variable = names[k];
+      if (position[variable] != unassigned) {
+        continue;
+      }
+      position[variable] = --highest_available;
+      for (size_t u = user_start[variable]; u < user_start[variable + 1]; u++) {
+        size_t affected = users[u];
+        remaining[affected]--;
+        if (not done[affected]) {
+          queue.emplace(remaining[affected], affected);
+        }
+      }
+    }
+  }
+  position_to_name.assign(n, "");
+  for (size_t i = 0; i < n; i++) {
+    name_to_position[interactions[i].target_name] = position[i];
+    position_to_name[position[i]] = interactions[i].target_name;
+  }
+}
+
+void Model::reorganize_greedy() {
   // interaction_with_remaining[X] stores the set of "interaction"s with X dependencies that don't
   // have positions yet
   vector<unordered_set<int>> interaction_with_remaining(interactions.size() + 1,
@@ -429,6 +1157,14 @@ void Model::reorganize() {
   }
 }
 
+double Model::state_space_size() const {
+  double result = 1;
+  for (size_t i = 0; i < size(); i++) {
+    result *= upper_bounds[i] - lower_bounds[i] + 1;
+  }
+  return result;
+}
+
 size_t Model::find_position(const string& name) const {
   auto result = name_to_position.find(name);
   if (result == name_to_position.end()) {
@@ -445,9 +1181,8 @@ void Model::print_header(std::ostream& out) const {
 }
 
 void Model::print(const vector<int>& current_state, std::ostream& out) const {
-  for (size_t i = 0; i < current_state.size(); i++) {
-    string column = original_ordering[i];
-    int value = current_state[name_to_position.at(column)];
+  for (const auto position : original_positions) {
+    int value = current_state[position];
     if (value >= 0) {
       out << " ";
     }
@@ -460,12 +1195,45 @@ vector<int> Model::load_state(string line) const {
   vector<int> result(size(), 0);
   istringstream iss(line);
   int value;
-  for (size_t column = 0; column < result.size(); column++) {
-    string name = original_ordering[column];
+  for (const auto position : original_positions) {
     iss >> value;
-    int position = name_to_position.at(name);
     result[position] = value;
   }
 
   return result;
 }
+
+size_t Model::binary_bits(size_t position) const {
+  size_t largest = upper_bounds[position] - lower_bounds[position];
+  size_t bits = 0;
+  while ((size_t(1) << bits) <= largest) {
+    bits++;
+  }
+  return bits;
+}
+
+size_t Model::binary_state_size() const {
+  size_t bits = 0;
+  for (size_t position = 0; position < size(); position++) {
+    bits += binary_bits(position);
+  }
+  return (bits + 7) / 8;
+}
+
+bool Model::load_binary_state(std::istream& in, vector<int>& state) const {
+  string record(binary_state_size(), 0);
+  if (not in.read(&record[0], record.size())) {
+    return false;
+  }
+  state.assign(size(), 0);
+  size_t bit = 0;
+  for (const auto position : original_positions) {
+    size_t bits = binary_bits(position);
+    int offset = 0;
+    for (size_t b = 0; b < bits; b++, bit++) {
+      offset |= ((record[bit / 8] >> (bit % 8)) & 1) << b;
+    }
+    state[position] = lower_bounds[position] + offset;
+  }
+  return true;
+}
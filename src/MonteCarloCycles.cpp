@@ -2,48 +2,289 @@
 
 // Find random strongly connected components using sampled Tarjan
 #include "MonteCarloCycles.h"
+#include "StateWriter.h"
+#include <thread>
 using std::endl;
-#include <unordered_set>
 
-void MonteCarloCycles::print(std::ostream& out) {
+template<typename Update>
+const uint32_t MonteCarloCycles<Update>::found;
+
+template<typename Update>
+double MonteCarloCycles<Update>::unseen_probability() const {
+  size_t singletons = 0, samples = 0;
+  for (const auto seen : cycle_seen) {
+    singletons += seen == 1;
+    samples += seen;
+  }
+  return ::unseen_probability(singletons, samples);
+}
+
+template<typename Update>
+bool MonteCarloCycles<Update>::confident() const {
+  return confidence > 0 and unseen_probability() <= 1 - confidence;
+}
+
+template<typename Update>
+void MonteCarloCycles<Update>::print(std::ostream& out) {
+  size_t samples = 0;
+  for (const auto seen : cycle_seen) {
+    samples += seen;
+  }
+  StateWriter writer(model, out);
   for (size_t i = 0; i < cycles.size(); i++) {
     // Output how many times this cycle was encountered by iteration
+    writer.flush();
     out << cycle_seen[i] << endl;
+    if (confidence > 0) {
+      auto interval = wilson_interval(cycle_seen[i], samples, confidence);
+      out << "# Frequency: " << double(cycle_seen[i]) / samples
+          << " Interval: " << interval.first << " " << interval.second << endl;
+    }
     // Output each state of the cycle
     for (const auto & state : cycles[i]) {
-      model.print(state, out);
+      writer.write(state);
     }
   }
+  writer.flush();
+  if (confidence > 0) {
+    out << "# Samples: " << samples << endl;
+    out << "# Unseen probability: " << unseen_probability() << endl;
+  }
 }
 
-void MonteCarloCycles::iterate() {
+template<typename Update>
+void MonteCarloCycles<Update>::iterate() {
   // Generate a random start state, then perform tarjan from it.
   tarjan(model.random_states(random));
 }
 
-bool MonteCarloCycles::tarjan(const vector<int>& start_state) {
-  // Keeps track of the depth-first-search being performed by tarjan.
-  vector<tarjan_container> state_stack;
-  // Allows you to convert a state to its index
-  unordered_map<vector<int>, size_t> state_to_index;
-  size_t index = 0;
+template<typename Update>
+void MonteCarloCycles<Update>::sample(size_t samples, size_t threads,
+                              unsigned seed) {
+  threads = std::max<size_t>(threads, 1);
+  if (threads == 1) {
+    std::seed_seq sequence = { seed, 0u };
+    random.seed(sequence);
+    for (size_t i = 0; i < samples; i++) {
+      if (i % 1000 == 0) {
+        if (i > 0 and confident()) {
+          std::cout << "Confidence reached after " << i << " iterations" << endl;
+          break;
+        }
+        std::cout << "Starting iteration: " << i << endl;
+      }
+      iterate();
+    }
+    return;
+  }
+  // Each worker keeps its own random stream for the whole run
+  vector<Random> streams;
+  for (size_t t = 0; t < threads; t++) {
+    std::seed_seq sequence = { seed, unsigned(t) };
+    streams.emplace_back(sequence);
+  }
+  // Workers live for the whole run so their basin caches keep growing across rounds
+  vector<MonteCarloCycles> workers;
+  // Reserved up front since each worker's tables point at its own packer
+  workers.reserve(threads);
+  for (size_t t = 0; t < threads; t++) {
+    workers.emplace_back(model, streams[t], stack_limit);
+    workers.back().shared = this;
+    workers.back().cache_limit = cache_limit;
+  }
+  // Large rounds keep merging cheap, small ones share discoveries sooner
+  const size_t round = 1000;
+  size_t done = 0;
+  while (done < samples) {
+    size_t per_worker = std::min(round, (samples - done + threads - 1) / threads);
+    for (auto & worker : workers) {
+      worker.shared_seen.assign(cycles.size(), 0);
+    }
+    vector<std::thread> running;
+    for (size_t t = 0; t < threads; t++) {
+      // The last round may not need every worker to do a full share
+      size_t count = std::min(per_worker, samples - std::min(samples, done + t * per_worker));
+      running.emplace_back([&workers, t, count]() {
+        for (size_t i = 0; i < count; i++) {
+          workers[t].iterate();
+        }
+      });
+    }
+    for (auto & thread : running) {
+      thread.join();
+    }
+    for (auto & worker : workers) {
+      merge(worker);
+    }
+    done = std::min(samples, done + per_worker * threads);
+    std::cout << "Completed iterations: " << done << " Cycles: "
+              << cycles.size() << endl;
+    // Only checked between rounds so the result doesn't depend on timing
+    if (confident()) {
+      std::cout << "Confidence reached after " << done << " iterations" << endl;
+      break;
+    }
+  }
+}
+
+template<typename Update>
+bool MonteCarloCycles<Update>::resolved(const vector<int>& state,
+                                        size_t& attractor) const {
+  const size_t offset = shared_seen.size();
+  auto seen = state_in_cycle.find(state);
+  if (seen != nullptr) {
+    attractor = offset + *seen;
+    return true;
+  }
+  auto cached = basin_cache.find(state);
+  if (cached != nullptr) {
+    attractor = *cached;
+    if (attractor & found) {
+      // Either merged in an earlier round or found during this one
+      size_t order = attractor & ~found;
+      attractor = order < merged_as.size() ?
+          merged_as[order] : offset + order - merged_as.size();
+    }
+    return true;
+  }
+  if (shared) {
+    auto earlier = shared->state_in_cycle.find(state);
+    if (earlier != nullptr) {
+      attractor = *earlier;
+      return true;
+    }
+  }
+  return false;
+}
+
+template<typename Update>
+void MonteCarloCycles<Update>::reached(size_t attractor) {
+  if (attractor < shared_seen.size()) {
+    shared_seen[attractor]++;
+  } else {
+    cycle_seen[attractor - shared_seen.size()]++;
+  }
+}
+
+template<typename Update>
+void MonteCarloCycles<Update>::cache_basin(const StateTable& states,
+                                           const vector<size_t>& path) {
+  if (cache_limit == 0) {
+    return;
+  }
+  vector<int> state(model.size());
+  Successors successors;
+  for (size_t i = path.size(); i-- > 0;) {
+    states.get(path[i], state);
+    size_t attractor;
+    // Part of the cycle that was just found
+    if (resolved(state, attractor)) {
+      continue;
+    }
+    update.successors(state, successors);
+    bool same = not successors.empty();
+    for (size_t j = 0; same and j < successors.size(); j++) {
+      size_t other;
+      // Look at the successor in place, then change it back
+      successors.apply(j, state);
+      same = resolved(state, other) and (j == 0 or other == attractor);
+      attractor = other;
+      successors.apply(j, state);
+    }
+    if (not same) {
+      return;
+    }
+    if (basin_cache.size() >= cache_limit) {
+      basin_cache.clear();
+    }
+    // Store this round's cycles by the order they were found in
+    const size_t offset = shared_seen.size();
+    basin_cache.insert(state, attractor < offset ?
+        attractor : found | (merged_as.size() + attractor - offset));
+  }
+}
+
+template<typename Update>
+void MonteCarloCycles<Update>::merge(MonteCarloCycles& worker) {
+  for (size_t i = 0; i < worker.shared_seen.size(); i++) {
+    cycle_seen[i] += worker.shared_seen[i];
+  }
+  for (size_t i = 0; i < worker.cycles.size(); i++) {
+    const auto & cycle = worker.cycles[i];
+    // An earlier worker may have found the same cycle this round
+    auto known = state_in_cycle.find(cycle[0]);
+    if (known != nullptr) {
+      cycle_seen[*known] += worker.cycle_seen[i];
+      worker.merged_as.push_back(*known);
+      continue;
+    }
+    cycles.push_back(cycle);
+    cycle_seen.push_back(worker.cycle_seen[i]);
+    worker.merged_as.push_back(cycles.size() - 1);
+    for (const auto& s : cycle) {
+      state_in_cycle[s] = cycles.size() - 1;
+    }
+  }
+  // Everything the worker found now lives here
+  worker.cycles.clear();
+  worker.cycle_seen.clear();
+  worker.state_in_cycle.clear();
+}
+
+template<typename Update>
+bool MonteCarloCycles<Update>::tarjan(const vector<int>& start_state) {
+  // Keeps track of the depth-first-search being performed by tarjan,
+  // with state_stack[i] belonging to the state with id i
+  vector<tarjan_frame> state_stack;
+  // Allows you to convert a state to its index, and back again
+  StateTable states(packer);
+  // Nothing to do if the start is already known to end in a cycle
+  size_t attractor;
+  if (resolved(start_state, attractor)) {
+    reached(attractor);
+    return false;
+  }
+  // Add a state to the top of the stack
+  auto push = [&](const vector<int>& state) {
+    size_t id = states.insert(state).first;
+    state_stack.push_back( { id, uint32_t(random()), 0 });
+    return id;
+  };
   // Initialize the stack with the start state
-  state_stack.emplace_back(start_state, index, model, random);
-  state_to_index[start_state] = index;
   // This is used to "recurse" back up one level of the DFS
-  vector<size_t> recursion_stack = { index };
-  index++;
+  vector<size_t> recursion_stack = { push(start_state) };
+  // The shuffled neighbors of the state at the top of the stack,
+  // which are kept until a different state is on top
+  size_t neighbors_of = -1;
+  vector<int> current(model.size());
+  Successors neighbors;
+  // The order to visit "neighbors" in
+  vector<size_t> order;
   while (not recursion_stack.empty()) {
-    // Get the tarjan_container at the top of the current stack
-    auto & state = state_stack[recursion_stack.back()];
+    // Get the tarjan_frame at the top of the current stack
+    size_t id = recursion_stack.back();
+    if (neighbors_of != id) {
+      states.get(id, current);
+      update.successors(current, neighbors);
+      order.resize(neighbors.size());
+      for (size_t i = 0; i < order.size(); i++) {
+        order[i] = i;
+      }
+      // Cheap to seed, unlike the main random number generator
+      std::minstd_rand shuffler(state_stack[id].seed);
+      shuffle(order.begin(), order.end(), shuffler);
+      neighbors_of = id;
+    }
+    auto & state = state_stack[id];
     // if you have explored all of this thing's links
-    if (state.unsearched_neighbors.empty()) {
+    if (state.cursor == neighbors.size()) {
       // If this state can't connect back up the stack, you found a sink
-      if (state.low_link == state.index) {
+      if (state.low_link == id) {
         // Record the found cycle
         vector<vector<int>> cycle;
-        for (size_t i = recursion_stack.back(); i < state_stack.size(); i++) {
-          cycle.push_back(state_stack[i].state);
+        for (size_t i = id; i < state_stack.size(); i++) {
+          states.get(i, current);
+          cycle.push_back(current);
         }
         cycles.push_back(cycle);
         if (cycles.back().size() > 1) {
@@ -55,46 +296,51 @@ bool MonteCarloCycles::tarjan(const vector<int>& start_state) {
         for (const auto& s : cycles.back()) {
           state_in_cycle[s] = cycles.size() - 1;
         }
+        cache_basin(states, recursion_stack);
         return true;
       }
       // Pop the stack and keep going
       recursion_stack.pop_back();
       continue;
     }
-    // More neighbors to explore
-    auto & next = state.unsearched_neighbors.back();
+    // More neighbors to explore, which "current" is turned into until the
+    // neighbor is applied again below
+    const size_t choice = order[state.cursor];
+    neighbors.apply(choice, current);
+    const auto & next = current;
     // If this state doesn't have an index yet
-    auto known = state_to_index.find(next);
-    if (known == state_to_index.end()) {
-      // If this state is part of a cycle we've already detected
-      auto seen = state_in_cycle.find(next);
-      if (seen != state_in_cycle.end()) {
-        cycle_seen[seen->second]++;
+    size_t known = states.find(next);
+    if (known == states.size()) {
+      // If this state is part of a cycle we've already detected, or only leads to one
+      if (resolved(next, attractor)) {
+        reached(attractor);
+        cache_basin(states, recursion_stack);
         // Stop, nothing new was found
         return false;
       }
       // Search has reached the size limit
-      if (index >= stack_limit) {
+      if (states.size() >= stack_limit) {
         std::cout << "Stack limited, stopping early" << endl;
         return false;
       }
       // Add it to the recursion stack
-      state_stack.emplace_back(next, index, model, random);
-      state_to_index[next] = index;
-      recursion_stack.push_back(index);
-      index++;
-      if (index % 10000 == 0) {
-        std::cout << "Stack size: " << index << endl;
+      recursion_stack.push_back(push(next));
+      if (states.size() % 10000 == 0) {
+        std::cout << "Stack size: " << states.size() << endl;
       }
     } else {
       // If you got here its because you just returned from a "recursion"
       // and we now need to update state's lowlink based on 'next's lowlink.
-      state.low_link = std::min(state.low_link,
-                                state_stack[known->second].low_link);
-      // Warning, after this line "next" is invalid
-      state.unsearched_neighbors.pop_back();
+      state.low_link = std::min(state.low_link, state_stack[known].low_link);
+      state.cursor++;
     }
+    neighbors.apply(choice, current);
   }
   throw std::invalid_argument("Reached impossible state in Monte Carlo Cycles");
   return false;
 }
+
+// Compile the engine for each update scheme
+template class MonteCarloCycles<SyncUpdate>;
+template class MonteCarloCycles<AsyncUpdate>;
+template class MonteCarloCycles<ClockUpdate>;
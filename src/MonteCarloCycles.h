@@ -4,15 +4,18 @@
 // find random strongly-connected-components of the model's transition graph.
 // These correspond to cycles the model can get in but cannot get out, such that
 // all states in the cycle can reach all other in the cycle.
-// This can work with either synchronously or asynchronously by modifying
-// a line lower in this file marked by "TODO"
+// The "Update" template parameter selects synchronous, asynchronous or clock
+// updates, see UpdatePolicy.h
 #ifndef MONTECARLOCYCLES_H_
 #define MONTECARLOCYCLES_H_
 
 #include <unordered_map>
 #include <algorithm>
 #include "Model.h"
+#include "PackedState.h"
+#include "UpdatePolicy.h"
 
+template<typename Update>
 class MonteCarloCycles {
  public:
   // "Stack Limit" is the maximum size of a component Tarjan can find before giving up.
@@ -20,25 +23,84 @@ class MonteCarloCycles {
   MonteCarloCycles(const Model& model_, Random & random_, size_t stack_limit_)
       : model(model_),
         random(random_),
-        stack_limit(stack_limit_) {
+        stack_limit(stack_limit_),
+        update(model_),
+        packer(model_),
+        state_in_cycle(packer),
+        basin_cache(packer),
+        cache_limit(1 << 20),
+        shared(nullptr),
+        confidence(0) {
   }
   ;
   // Start from a random state, perform Tarjan until a stable cycle is found, then add it to the cycles
   void iterate();
+  // Performs "samples" iterations using "threads" workers. Each worker draws from its
+  // own random stream derived from "seed". Work is done in rounds, with each worker's
+  // new cycles merged in worker order after every round, so the results only
+  // depend on "seed" and "threads".
+  void sample(size_t samples, size_t threads, unsigned seed);
+  // If "confidence_" is above 0, "sample" stops early once the estimated probability
+  // that another sample finds a new cycle is at most 1 - confidence_, and
+  // "print" includes a confidence interval for how often each cycle is reached.
+  void set_confidence(double confidence_) {
+    confidence = confidence_;
+  }
+  // Caps how many transient states are remembered in "basin_cache", which is
+  // emptied whenever it fills up. 0 turns the cache off.
+  void set_cache_limit(size_t cache_limit_) {
+    cache_limit = cache_limit_;
+  }
+  // Good-Turing estimate of the probability the next sample finds a new cycle
+  double unseen_probability() const;
   // Print out all of the cycles to the file
   void print(std::ostream& out);
  private:
   const Model& model;
   Random& random;
   size_t stack_limit;
+  // Generates the successors of each state
+  Update update;
   // A vector cycles, where each cycle is a vector of states
   // where each state is a vector of ints.
   vector<vector<vector<int>>> cycles;
   // Count how many times each cycle is encountered
   vector<int> cycle_seen;
+  // Converts states into compact keys for hash tables
+  StatePacker packer;
   // Maps a state to the position in "cycle_seen" corresponding to that
   // state's previously found cycle
-  std::unordered_map<vector<int>, size_t> state_in_cycle;
+  StateMap<size_t> state_in_cycle;
+  // Maps transient states to the cycle every path from them ends in, so later
+  // searches can stop as soon as they reach one. Values with the "found" bit set are
+  // the cycles this object found, numbered in the order they were found, and the rest
+  // are numbered as in "shared". A worker's cache therefore stays valid across rounds.
+  StateMap<uint32_t> basin_cache;
+  static const uint32_t found = uint32_t(1) << 31;
+  size_t cache_limit;
+  // Cycles found in previous rounds, which workers read but never change
+  const MonteCarloCycles* shared;
+  // How many times each of the "shared" cycles was reached this round
+  vector<int> shared_seen;
+  // Where each cycle this worker found in earlier rounds was merged into "shared"
+  vector<size_t> merged_as;
+  double confidence;
+  // Returns true once "confidence" has been reached
+  bool confident() const;
+  // Sets "attractor" and returns true if every path from "state" is known to end in
+  // the same cycle. Cycles below shared_seen.size() are numbered as in "shared",
+  // the rest are this round's "cycles" offset by that.
+  bool resolved(const vector<int>& state, size_t& attractor) const;
+  // Counts reaching the cycle "attractor", numbered the same way as "resolved"
+  void reached(size_t attractor);
+  // Walks back down the depth-first "path" of states, remembering each one whose
+  // successors all end in the same cycle. Stops at the first that doesn't, as its
+  // parent has it as a successor. Synchronous updates have a single successor,
+  // so every state on the path is remembered.
+  void cache_basin(const StateTable& states, const vector<size_t>& path);
+  // Adds everything "worker" found during a round into these cycles, then
+  // empties the worker's round so it can start the next one
+  void merge(MonteCarloCycles& worker);
   // Performs the tarjan algorithm starting from start_state until the first
   // strongly connected component is found, or the stack limit is reached.
   // For more details see:
@@ -47,28 +109,16 @@ class MonteCarloCycles {
 };
 
 // Helper data structure that stores all information needed by a stack level of tarjan.
-struct tarjan_container {
-  // The current model state for this level of the stack
-  vector<int> state;
-  // List of all outbound edges from "state" that haven't been explored yet.
-  vector<vector<int>> unsearched_neighbors;
-  // Index identifies what order this state was found in
-  size_t index = 0;
-  // low_link is the lowest index reachable by performing depth-first-search from "state"
-  size_t low_link = 0;
-
-  tarjan_container() = default;
-  tarjan_container(const vector<int> & s, size_t i, const Model& model,
-                   Random & random)
-      : state(s),
-        index(i),
-        low_link(i) {
-    //unsearched_neighbors.push_back(model.get_sync_next(state));
-    // TODO To switch between synchronous and asynchronous, uncomment/comment the line above
-    // and comment / uncomment the line below.
-    unsearched_neighbors = model.get_clock_next_states(state);
-    shuffle(unsearched_neighbors.begin(), unsearched_neighbors.end(), random);
-  }
+// The state itself lives in an interned StateTable, with its id giving the order it
+// was found in. Neighbors are regenerated when needed and visited in the order
+// given by shuffling them with "seed", so each level only needs a few words.
+struct tarjan_frame {
+  // low_link is the lowest index reachable by performing depth-first-search from this state
+  size_t low_link;
+  // Seeds the random order neighbors are explored in
+  uint32_t seed;
+  // How many neighbors have been fully explored
+  uint32_t cursor;
 };
 
 #endif /* MONTECARLOCYCLES_H_ */
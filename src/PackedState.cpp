@@ -0,0 +1,151 @@
+// Brian Goldman
+
+// Packing and hashing of compact state keys
+#include "PackedState.h"
+#include <stdexcept>
+
+StatePacker::StatePacker(const Model& model) {
+  // Bit 0 of the first word marks the slot as used
+  size_t bit = 1;
+  word_count = 1;
+  for (size_t position = 0; position < model.size(); position++) {
+    const auto & interaction = model.get_interactions()[position];
+    size_t bits = model.binary_bits(position);
+    // Never split a variable across two words
+    if (bit + bits > 64) {
+      word_count++;
+      bit = 0;
+    }
+    word.push_back(word_count - 1);
+    shift.push_back(bit);
+    mask.push_back(bits == 64 ? ~uint64_t(0) : (uint64_t(1) << bits) - 1);
+    lower_bounds.push_back(interaction.lower_bound);
+    bit += bits;
+  }
+}
+
+void StatePacker::pack(const vector<int>& state, uint64_t* key) const {
+  std::fill(key, key + word_count, 0);
+  key[0] = 1;
+  for (size_t position = 0; position < lower_bounds.size(); position++) {
+    key[word[position]] |= uint64_t(state[position] - lower_bounds[position])
+        << shift[position];
+  }
+}
+
+void StatePacker::unpack(const uint64_t* key, vector<int>& state) const {
+  for (size_t position = 0; position < lower_bounds.size(); position++) {
+    state[position] = lower_bounds[position]
+        + int((key[word[position]] >> shift[position]) & mask[position]);
+  }
+}
+
+size_t StatePacker::hash(const uint64_t* key) const {
+  uint64_t result = 0;
+  for (size_t i = 0; i < word_count; i++) {
+    // Finalizer from splitmix64
+    uint64_t z = result ^ key[i];
+    z += 0x9e3779b97f4a7c15;
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111eb;
+    result = z ^ (z >> 31);
+  }
+  return result;
+}
+
+const uint32_t StateTable::empty;
+
+StateTable::StateTable(const StatePacker& packer_)
+    : packer(&packer_),
+      words(packer_.words()),
+      count(0),
+      slots(16, empty),
+      scratch(packer_.words()) {
+}
+
+size_t StateTable::locate(const uint64_t* key) const {
+  const size_t last = slots.size() - 1;
+  size_t slot = packer->hash(key) & last;
+  while (slots[slot] != empty
+      and not std::equal(key, key + words, &keys[slots[slot] * words])) {
+    slot = (slot + 1) & last;
+  }
+  return slot;
+}
+
+size_t StateTable::find(const vector<int>& state) const {
+  uint64_t local[8];
+  vector<uint64_t> large;
+  uint64_t* key = local;
+  if (words > 8) {
+    large.resize(words);
+    key = large.data();
+  }
+  packer->pack(state, key);
+  uint32_t id = slots[locate(key)];
+  return id == empty ? count : id;
+}
+
+std::pair<size_t, bool> StateTable::insert(const vector<int>& state) {
+  if (4 * (count + 1) > 3 * slots.size()) {
+    grow();
+  }
+  packer->pack(state, scratch.data());
+  size_t slot = locate(scratch.data());
+  if (slots[slot] != empty) {
+    return {slots[slot], false};
+  }
+  if (count >= empty) {
+    throw std::invalid_argument("Too many states to intern");
+  }
+  slots[slot] = count;
+  keys.insert(keys.end(), scratch.begin(), scratch.end());
+  return {count++, true};
+}
+
+void StateTable::grow() {
+  slots.assign(slots.size() * 2, empty);
+  for (size_t id = 0; id < count; id++) {
+    slots[locate(&keys[id * words])] = id;
+  }
+}
+
+void StateTable::clear() {
+  count = 0;
+  keys.clear();
+  slots.assign(16, empty);
+}
+
+const uint32_t EdgeCounts::missing;
+
+EdgeCounts::EdgeCounts(const StatePacker& packer_)
+    : states(packer_),
+      width(packer_.size() + 1) {
+}
+
+size_t EdgeCounts::column(const vector<int>& from, const vector<int>& to) const {
+  size_t changed = width - 1;
+  for (size_t i = 0; i < from.size(); i++) {
+    if (from[i] != to[i]) {
+      if (changed != width - 1) {
+        return width - 1;
+      }
+      changed = i;
+    }
+  }
+  return changed;
+}
+
+void EdgeCounts::merge(const EdgeCounts& other) {
+  vector<int> from(width - 1);
+  for (size_t id = 0; id < other.size(); id++) {
+    other.get(id, from);
+    size_t mine = insert(from).first;
+    for (size_t c = 0; c < width; c++) {
+      uint32_t added = other.at(id, c);
+      if (added != missing) {
+        add(mine, c, added);
+      }
+    }
+  }
+}
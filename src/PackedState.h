@@ -0,0 +1,258 @@
+// Brian Goldman
+
+// Compact keys for storing states in hash tables. A vector<int> state costs
+// a separate heap allocation of 4 bytes per variable, while almost every variable
+// only needs 2 bits. StatePacker stores each variable as (value - lower_bound)
+// in just enough bits, packed into a fixed number of 64 bit words, and StateMap
+// is an open addressing hash table storing those words contiguously.
+#ifndef PACKEDSTATE_H_
+#define PACKEDSTATE_H_
+
+#include "Model.h"
+#include <cstdint>
+
+class StatePacker {
+ public:
+  StatePacker(const Model& model);
+  // How many 64 bit words each packed state uses
+  size_t words() const {
+    return word_count;
+  }
+  // Writes "state" into key[0] up to key[words() - 1]. Bit 0 of the
+  // first word is always set so an all zero key can mark an empty slot.
+  void pack(const vector<int>& state, uint64_t* key) const;
+  // Converts a packed key back into a state, which must already be the right size
+  void unpack(const uint64_t* key, vector<int>& state) const;
+  // Mixes every word of the key so nearby states spread across the table
+  size_t hash(const uint64_t* key) const;
+  size_t size() const {
+    return lower_bounds.size();
+  }
+ private:
+  size_t word_count;
+  // For each position, which word and bit it starts at and how many bits it uses
+  vector<size_t> word;
+  vector<size_t> shift;
+  vector<uint64_t> mask;
+  vector<int> lower_bounds;
+};
+
+// Maps states to values of type V using linear probing. Entries cannot be removed
+// individually, but the whole table can be cleared.
+template<typename V>
+class StateMap {
+ public:
+  StateMap(const StatePacker& packer_, size_t capacity_ = 16)
+      : packer(&packer_),
+        words(packer_.words()),
+        entries(0) {
+    size_t capacity = 16;
+    while (capacity < capacity_) {
+      capacity <<= 1;
+    }
+    keys.assign(capacity * words, 0);
+    values.resize(capacity);
+    scratch.resize(words);
+  }
+  size_t size() const {
+    return entries;
+  }
+  bool empty() const {
+    return entries == 0;
+  }
+  // Returns the value stored for "state", or nullptr if it isn't in the table.
+  // Safe to call from multiple threads as long as nothing is being inserted.
+  const V* find(const vector<int>& state) const {
+    // Most models fit on the stack, which avoids sharing any scratch space
+    uint64_t local[8];
+    vector<uint64_t> large;
+    uint64_t* key = local;
+    if (words > 8) {
+      large.resize(words);
+      key = large.data();
+    }
+    packer->pack(state, key);
+    size_t slot = locate(key);
+    return keys[slot * words] ? &values[slot] : nullptr;
+  }
+  V* find(const vector<int>& state) {
+    return const_cast<V*>(static_cast<const StateMap*>(this)->find(state));
+  }
+  size_t count(const vector<int>& state) const {
+    return find(state) != nullptr;
+  }
+  // Adds "state" with "value" if it isn't already present. Returns where the value
+  // for "state" is stored and true if it was inserted.
+  std::pair<V*, bool> insert(const vector<int>& state, const V& value = V()) {
+    // Grow once three quarters full
+    if (4 * (entries + 1) > 3 * values.size()) {
+      grow();
+    }
+    packer->pack(state, scratch.data());
+    size_t slot = locate(scratch.data());
+    if (keys[slot * words]) {
+      return {&values[slot], false};
+    }
+    std::copy(scratch.begin(), scratch.end(), keys.begin() + slot * words);
+    values[slot] = value;
+    entries++;
+    return {&values[slot], true};
+  }
+  // Equivalent to std::unordered_map's operator[]
+  V& operator[](const vector<int>& state) {
+    return *insert(state).first;
+  }
+  // Removes everything. Capacity is kept if it was being used, otherwise
+  // the table shrinks so clearing stays proportional to how full it was.
+  void clear() {
+    if (entries == 0) {
+      return;
+    }
+    size_t capacity = 16;
+    while (capacity < 2 * entries) {
+      capacity <<= 1;
+    }
+    if (capacity < values.size() / 2) {
+      keys.assign(capacity * words, 0);
+      values.assign(capacity, V());
+    } else {
+      std::fill(keys.begin(), keys.end(), 0);
+      std::fill(values.begin(), values.end(), V());
+    }
+    entries = 0;
+  }
+  // Calls function(state, value) on every entry
+  template<typename Function>
+  void for_each(Function function) const {
+    vector<int> state(packer->size());
+    for (size_t slot = 0; slot < values.size(); slot++) {
+      if (keys[slot * words]) {
+        packer->unpack(&keys[slot * words], state);
+        function(state, values[slot]);
+      }
+    }
+  }
+ private:
+  const StatePacker* packer;
+  size_t words;
+  size_t entries;
+  // Slot i's key is keys[i * words] up to keys[(i + 1) * words]
+  vector<uint64_t> keys;
+  vector<V> values;
+  // Space to pack the state currently being inserted
+  vector<uint64_t> scratch;
+  // Finds the slot holding "key", or the empty slot where it should go
+  size_t locate(const uint64_t* key) const {
+    const size_t last = values.size() - 1;
+    size_t slot = packer->hash(key) & last;
+    while (keys[slot * words]
+        and not std::equal(key, key + words, &keys[slot * words])) {
+      slot = (slot + 1) & last;
+    }
+    return slot;
+  }
+  void grow() {
+    vector<uint64_t> old_keys(values.size() * 2 * words, 0);
+    vector<V> old_values(values.size() * 2);
+    old_keys.swap(keys);
+    old_values.swap(values);
+    for (size_t slot = 0; slot < old_values.size(); slot++) {
+      if (old_keys[slot * words]) {
+        size_t moved = locate(&old_keys[slot * words]);
+        std::copy(&old_keys[slot * words], &old_keys[slot * words] + words,
+                  &keys[moved * words]);
+        values[moved] = std::move(old_values[slot]);
+      }
+    }
+  }
+};
+
+// Sets only need to know if a state is present
+typedef StateMap<char> StateSet;
+
+// Interns states, giving each new state the next id in order. Each packed state is
+// stored exactly once, with the hash index holding only ids.
+class StateTable {
+ public:
+  StateTable(const StatePacker& packer_);
+  size_t size() const {
+    return count;
+  }
+  // Returns the id of "state", or size() if it hasn't been added
+  size_t find(const vector<int>& state) const;
+  // Returns the id of "state" and true if it was newly added
+  std::pair<size_t, bool> insert(const vector<int>& state);
+  // Writes the state with the given id into "state", which must already be the right size
+  void get(size_t id, vector<int>& state) const {
+    packer->unpack(&keys[id * words], state);
+  }
+  void clear();
+ private:
+  const StatePacker* packer;
+  size_t words;
+  size_t count;
+  // State "id" is keys[id * words] up to keys[(id + 1) * words]
+  vector<uint64_t> keys;
+  // Open addressing index of ids, where "empty" marks unused slots
+  vector<uint32_t> slots;
+  static const uint32_t empty = ~uint32_t(0);
+  vector<uint64_t> scratch;
+  // Finds the slot holding "key", or the empty slot where it should go
+  size_t locate(const uint64_t* key) const;
+  void grow();
+};
+
+// Counts transitions out of interned states. Asynchronous and clock transitions
+// change exactly one variable, so a transition is identified by its source state's
+// id and the position that changed, with a row of size() + 1 counters per state.
+// The last column is for transitions changing several variables at once, which a
+// synchronous update does. Transitions that cannot happen are marked "missing".
+class EdgeCounts {
+ public:
+  EdgeCounts(const StatePacker& packer_);
+  static const uint32_t missing = ~uint32_t(0);
+  // Which column the transition from "from" to "to" is counted in
+  size_t column(const vector<int>& from, const vector<int>& to) const;
+  // Returns the id of "from" and true if it was newly added. New rows start as missing.
+  std::pair<size_t, bool> insert(const vector<int>& from) {
+    auto result = states.insert(from);
+    if (result.second) {
+      counts.resize(counts.size() + width, missing);
+    }
+    return result;
+  }
+  // Returns the id of "from", or size() if it hasn't been added
+  size_t find(const vector<int>& from) const {
+    return states.find(from);
+  }
+  size_t size() const {
+    return states.size();
+  }
+  void get(size_t id, vector<int>& from) const {
+    states.get(id, from);
+  }
+  // The count for transition "column" out of state "id", which is a reference
+  // so a missing transition can be set to 0 once it is known to be possible
+  uint32_t& at(size_t id, size_t column) {
+    return counts[id * width + column];
+  }
+  uint32_t at(size_t id, size_t column) const {
+    return counts[id * width + column];
+  }
+  // Adds "amount" to the count for transition "column" out of state "id", treating
+  // missing as 0. Counts stop at "missing - 1" instead of wrapping around.
+  void add(size_t id, size_t column, uint32_t amount = 1) {
+    uint32_t& count = at(id, column);
+    uint32_t current = count == missing ? 0 : count;
+    count = amount < missing - current ? current + amount : missing - 1;
+  }
+  // Adds every count in "other", which may use a different packer
+  void merge(const EdgeCounts& other);
+ private:
+  StateTable states;
+  size_t width;
+  // Row "id" is counts[id * width] up to counts[(id + 1) * width]
+  vector<uint32_t> counts;
+};
+
+#endif /* PACKEDSTATE_H_ */
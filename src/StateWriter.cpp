@@ -0,0 +1,72 @@
+// Brian Goldman
+
+// Buffered state output
+#include "StateWriter.h"
+#include <stdexcept>
+
+StateWriter::StateWriter(const Model& model, std::ostream& out_,
+                         Format format_, size_t capacity_)
+    : out(out_),
+      format(format_),
+      capacity(capacity_),
+      positions(model.get_original_positions()),
+      record_size(model.binary_state_size()) {
+  for (const auto position : positions) {
+    lower_bounds.push_back(model.get_interactions()[position].lower_bound);
+    bits.push_back(model.binary_bits(position));
+  }
+  buffer.reserve(capacity);
+}
+
+StateWriter::~StateWriter() {
+  flush();
+}
+
+StateWriter::Format StateWriter::parse_format(const string& name) {
+  if (name == "text") {
+    return TEXT;
+  } else if (name == "binary") {
+    return BINARY;
+  }
+  throw std::invalid_argument("Unknown state format: " + name);
+}
+
+void StateWriter::write(const vector<int>& state) {
+  if (format == TEXT) {
+    // Matches Model::print, which puts a space in place of the minus sign
+    for (const auto position : positions) {
+      int value = state[position];
+      if (value >= 0) {
+        buffer.push_back(' ');
+      } else {
+        buffer.push_back('-');
+        value = -value;
+      }
+      if (value < 10) {
+        buffer.push_back('0' + value);
+      } else {
+        buffer.append(std::to_string(value));
+      }
+      buffer.push_back(' ');
+    }
+    buffer.push_back('\n');
+  } else {
+    size_t start = buffer.size();
+    buffer.append(record_size, 0);
+    size_t bit = 0;
+    for (size_t column = 0; column < positions.size(); column++) {
+      unsigned offset = state[positions[column]] - lower_bounds[column];
+      for (size_t b = 0; b < bits[column]; b++, bit++) {
+        buffer[start + bit / 8] |= ((offset >> b) & 1) << (bit % 8);
+      }
+    }
+  }
+  if (buffer.size() >= capacity) {
+    flush();
+  }
+}
+
+void StateWriter::flush() {
+  out.write(buffer.data(), buffer.size());
+  buffer.clear();
+}
@@ -0,0 +1,52 @@
+// Brian Goldman
+
+// Writes states much faster than Model::print by looking up the original
+// column order once and formatting into a large reusable buffer, which is only
+// handed to the stream when it fills up or "flush" is called. Can write either
+// the same text format as Model::print, or the compact binary format
+// that Model::load_binary_state reads.
+#ifndef STATEWRITER_H_
+#define STATEWRITER_H_
+
+#include "Model.h"
+#include <ostream>
+
+class StateWriter {
+ public:
+  enum Format {
+    TEXT,
+    BINARY
+  };
+  StateWriter(const Model& model, std::ostream& out_, Format format_ = TEXT,
+              size_t capacity_ = 1 << 20);
+  // Anything still in the buffer is written to the stream
+  ~StateWriter();
+  void write(const vector<int>& state);
+  // Moves everything in the buffer to the stream. Call this before writing
+  // anything to the stream directly. Does not flush the stream itself.
+  void flush();
+  std::ostream& stream() {
+    return out;
+  }
+  Format get_format() const {
+    return format;
+  }
+  // Converts "text" or "binary" into a Format
+  static Format parse_format(const string& name);
+  // True if "parse_format" accepts "name"
+  static bool known_format(const string& name) {
+    return name == "text" or name == "binary";
+  }
+ private:
+  std::ostream& out;
+  Format format;
+  size_t capacity;
+  string buffer;
+  // Position, lower bound and binary width of each column in the original order
+  vector<size_t> positions;
+  vector<int> lower_bounds;
+  vector<size_t> bits;
+  size_t record_size;
+};
+
+#endif /* STATEWRITER_H_ */
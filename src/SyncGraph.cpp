@@ -0,0 +1,236 @@
+// Brian Goldman
+
+// Builds, stores and analyzes the synchronous functional graph
+#include "SyncGraph.h"
+#include "BatchSync.h"
+#include "StateWriter.h"
+#include <atomic>
+#include <thread>
+#include <cstring>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using std::cout;
+using std::endl;
+
+namespace {
+// Identifies successor table files
+const char magic[8] = { 'H', 'S', 'Y', 'N', 'C', 'v', '1', 0 };
+struct Header {
+  char magic[8];
+  uint64_t states;
+  uint64_t fingerprint;
+};
+// Labels used while finding basins, which can never be valid attractor numbers
+const uint32_t unvisited = ~uint32_t(0);
+const uint32_t pending = unvisited - 1;
+
+// FNV-1a, which is plenty to notice the model file changed
+void mix(uint64_t& hash, uint64_t value) {
+  for (size_t i = 0; i < 8; i++) {
+    hash ^= (value >> (8 * i)) & 0xFF;
+    hash *= 1099511628211ULL;
+  }
+}
+}
+
+SyncGraph::SyncGraph(const Model& model_)
+    : model(model_),
+      total(0),
+      fingerprint(14695981039346656037ULL),
+      next(nullptr),
+      mapped(nullptr),
+      mapped_size(0) {
+  if (not supported(model)) {
+    throw std::invalid_argument(
+        "State space is too large for a synchronous successor table");
+  }
+  total = model.state_space_size();
+  for (const auto & interaction : model.get_interactions()) {
+    for (const auto c : interaction.target_name) {
+      mix(fingerprint, c);
+    }
+    mix(fingerprint, interaction.lower_bound);
+    mix(fingerprint, interaction.upper_bound);
+    mix(fingerprint, interaction.activators.size());
+    for (const auto source : interaction.activators) {
+      mix(fingerprint, source);
+    }
+    mix(fingerprint, interaction.inhibitors.size());
+    for (const auto source : interaction.inhibitors) {
+      mix(fingerprint, source);
+    }
+  }
+}
+
+SyncGraph::~SyncGraph() {
+  unmap();
+}
+
+bool SyncGraph::supported(const Model& model) {
+  // The two largest values are reserved as labels
+  return model.state_space_size() <= double(pending - 1);
+}
+
+void SyncGraph::unmap() {
+  if (mapped) {
+    munmap(mapped, mapped_size);
+    mapped = nullptr;
+    mapped_size = 0;
+  }
+}
+
+void SyncGraph::build(size_t threads) {
+  unmap();
+  built.resize(total);
+  // Workers claim blocks of consecutive ranks and update them with the bit sliced kernel
+  const size_t block_size = BatchSync::width();
+  std::atomic<size_t> next_block(0);
+  auto worker = [&]() {
+    BatchSync batch(model);
+    vector<vector<int>> block(block_size, vector<int>(model.size()));
+    size_t first;
+    while ((first = block_size * next_block++) < total) {
+      size_t count = std::min(block_size, total - first);
+      block.resize(count);
+      for (size_t i = 0; i < count; i++) {
+        model.unrank(first + i, block[i]);
+      }
+      batch.get_sync_next(block);
+      for (size_t i = 0; i < count; i++) {
+        built[first + i] = model.rank(block[i]);
+      }
+    }
+  };
+  vector<std::thread> workers;
+  for (size_t t = 1; t < threads; t++) {
+    workers.emplace_back(worker);
+  }
+  worker();
+  for (auto & thread : workers) {
+    thread.join();
+  }
+  next = built.data();
+}
+
+void SyncGraph::save(const string& filename) const {
+  Header header;
+  std::memcpy(header.magic, magic, sizeof(magic));
+  header.states = total;
+  header.fingerprint = fingerprint;
+  std::ofstream out(filename, std::ios::binary);
+  out.write(reinterpret_cast<const char*>(&header), sizeof(header));
+  out.write(reinterpret_cast<const char*>(next), total * sizeof(uint32_t));
+  if (not out) {
+    throw std::invalid_argument("Unable to write successor table: " + filename);
+  }
+}
+
+bool SyncGraph::load(const string& filename) {
+  int file = open(filename.c_str(), O_RDONLY);
+  if (file < 0) {
+    return false;
+  }
+  struct stat info;
+  size_t expected = sizeof(Header) + total * sizeof(uint32_t);
+  if (fstat(file, &info) != 0 or size_t(info.st_size) != expected) {
+    close(file);
+    return false;
+  }
+  void* region = mmap(nullptr, expected, PROT_READ, MAP_PRIVATE, file, 0);
+  close(file);
+  if (region == MAP_FAILED) {
+    return false;
+  }
+  const Header* header = static_cast<const Header*>(region);
+  if (std::memcmp(header->magic, magic, sizeof(magic)) != 0
+      or header->states != total or header->fingerprint != fingerprint) {
+    munmap(region, expected);
+    return false;
+  }
+  // A damaged table could send find_attractors outside of its arrays
+  const uint32_t* table = reinterpret_cast<const uint32_t*>(
+      static_cast<const char*>(region) + sizeof(Header));
+  for (size_t rank = 0; rank < total; rank++) {
+    if (table[rank] >= total) {
+      munmap(region, expected);
+      return false;
+    }
+  }
+  unmap();
+  built.clear();
+  built.shrink_to_fit();
+  mapped = region;
+  mapped_size = expected;
+  next = table;
+  return true;
+}
+
+void SyncGraph::find_attractors(std::ostream& out) const {
+  // label[rank] is the attractor that state ends up in. Each unlabeled state
+  // is followed until it reaches a labeled state, or loops back onto
+  // the current path, which is a brand new attractor. Every state on
+  // the path then gets the same label, so every state is walked once.
+  vector<uint32_t> label(total, unvisited);
+  vector<uint32_t> path;
+  // Lowest rank, cycle length and basin size of each attractor
+  vector<size_t> lowest, length, basin;
+  for (size_t start = 0; start < total; start++) {
+    if (label[start] != unvisited) {
+      continue;
+    }
+    path.clear();
+    uint32_t current = start;
+    while (label[current] == unvisited) {
+      label[current] = pending;
+      path.push_back(current);
+      current = next[current];
+    }
+    uint32_t attractor = label[current];
+    if (attractor == pending) {
+      attractor = lowest.size();
+      size_t low = current;
+      size_t steps = 0;
+      uint32_t walk = current;
+      do {
+        low = std::min<size_t>(low, walk);
+        steps++;
+        walk = next[walk];
+      } while (walk != current);
+      lowest.push_back(low);
+      length.push_back(steps);
+      basin.push_back(0);
+    }
+    for (const auto rank : path) {
+      label[rank] = attractor;
+    }
+    basin[attractor] += path.size();
+  }
+
+  // Output attractors in order of their lowest state
+  vector<size_t> order(lowest.size());
+  for (size_t i = 0; i < order.size(); i++) {
+    order[i] = i;
+  }
+  std::sort(order.begin(), order.end(), [&lowest](size_t a, size_t b) {
+    return lowest[a] < lowest[b];
+  });
+  model.print_header(out);
+  StateWriter writer(model, out);
+  vector<int> state(model.size());
+  for (const auto attractor : order) {
+    writer.flush();
+    out << length[attractor] << endl;
+    size_t rank = lowest[attractor];
+    for (size_t step = 0; step < length[attractor]; step++) {
+      model.unrank(rank, state);
+      writer.write(state);
+      rank = next[rank];
+    }
+    writer.flush();
+    out << "# Basin: " << basin[attractor] << endl << endl;
+  }
+  cout << "Attractors: " << lowest.size() << endl;
+}
@@ -0,0 +1,47 @@
+// Brian Goldman
+
+// Stores the entire synchronous transition function as an array, where
+// next[rank] is the rank of the state reached by a synchronous update from the
+// state with that rank (see Model::rank). Every state has exactly one successor,
+// so the transition graph is a functional graph: each weakly connected piece is
+// a single attractor cycle with trees of transient states flowing into it.
+// This makes finding every attractor and the exact size of its basin a couple
+// of linear passes over arrays.
+
+#ifndef SYNCGRAPH_H_
+#define SYNCGRAPH_H_
+
+#include "Model.h"
+#include <cstdint>
+#include <ostream>
+
+class SyncGraph {
+ public:
+  SyncGraph(const Model& model_);
+  ~SyncGraph();
+  // Returns true if every rank fits in the table
+  static bool supported(const Model& model);
+  // Computes the successor of every state using "threads" workers
+  void build(size_t threads);
+  // Writes the table to "filename" so it can be reused by "load"
+  void save(const string& filename) const;
+  // Memory maps a table written by "save". Returns false if the file doesn't
+  // exist, was built from a different model or has a successor out of range.
+  bool load(const string& filename);
+  // Finds every attractor and writes each one starting from its lowest state,
+  // sorted by that state, followed by how many states end up in that attractor.
+  void find_attractors(std::ostream& out) const;
+ private:
+  const Model& model;
+  size_t total;
+  // Summarizes everything about the model that changes the transition function
+  uint64_t fingerprint;
+  // Either points into "built" or into a memory mapped file
+  const uint32_t* next;
+  vector<uint32_t> built;
+  void* mapped;
+  size_t mapped_size;
+  void unmap();
+};
+
+#endif /* SYNCGRAPH_H_ */
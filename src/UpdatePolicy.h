@@ -0,0 +1,119 @@
+// Brian Goldman
+
+// Update schemes used as template parameters by the exploration engines
+// (MonteCarloCycles, WalkCycle and the GraphViz conversion). Each policy is built
+// from a model and gives every state that can follow "state" under its scheme.
+// Since the policy is a template parameter, each engine is compiled once per
+// scheme with the successor generation inlined, instead of checking which scheme
+// to use every time a state is expanded.
+#ifndef UPDATEPOLICY_H_
+#define UPDATEPOLICY_H_
+
+#include "Model.h"
+#include <stdexcept>
+
+// The successors of one state, stored as the changes that turn that state into each
+// successor instead of as copies of it. Asynchronous and clock successors each change
+// exactly one variable. Reusing the same Successors for every state means nothing is
+// allocated once it has grown large enough.
+class Successors {
+ public:
+  size_t size() const {
+    return start.size() - 1;
+  }
+  bool empty() const {
+    return size() == 0;
+  }
+  // Turns "state" into successor "i" in place. Calling it again with the same
+  // "state" turns it back, so a successor can be visited without copying "state".
+  void apply(size_t i, vector<int>& state) {
+    for (size_t c = start[i]; c < start[i + 1]; c++) {
+      std::swap(state[changes[c].first], changes[c].second);
+    }
+  }
+  // How many variables successor "i" changes
+  size_t changed(size_t i) const {
+    return start[i + 1] - start[i];
+  }
+  // The first position successor "i" changes, if it changes anything
+  size_t position(size_t i) const {
+    return changes[start[i]].first;
+  }
+  void clear() {
+    changes.clear();
+    start.assign(1, 0);
+  }
+  // Adds a successor that doesn't change anything yet
+  void add() {
+    start.push_back(changes.size());
+  }
+  // Adds "position" changing to "value" as part of the last successor
+  void extend(size_t position, int value) {
+    changes.emplace_back(position, value);
+    start.back() = changes.size();
+  }
+  // Adds a successor changing only "position" to "value"
+  void add(size_t position, int value) {
+    add();
+    extend(position, value);
+  }
+ private:
+  // Successor i is changes[start[i]] up to changes[start[i + 1]],
+  // each being a position and the value it is swapped with
+  vector<std::pair<size_t, int>> changes;
+  vector<size_t> start = vector<size_t>(1, 0);
+};
+
+// Every interaction updates at the same time, giving exactly one successor
+struct SyncUpdate {
+  SyncUpdate(const Model& model_)
+      : model(model_) {
+  }
+  void successors(const vector<int>& state, Successors& result) const {
+    result.clear();
+    result.add();
+    for (size_t i = 0; i < state.size(); i++) {
+      int next_state = model.get_next_state(i, state);
+      if (next_state != state[i]) {
+        result.extend(i, next_state);
+      }
+    }
+  }
+  const Model& model;
+};
+
+// One interaction updates at a time, giving a successor for every
+// interaction that wants to change.
+struct AsyncUpdate {
+  AsyncUpdate(const Model& model_)
+      : model(model_) {
+  }
+  void successors(const vector<int>& state, Successors& result) const {
+    result.clear();
+    model.for_each_async_change(state, [&result](size_t position, int value) {
+      result.add(position, value);
+    });
+  }
+  const Model& model;
+};
+
+// Asynchronous updates where "CLOCK" decides which phase of variables is allowed
+// to update, see Model::get_clock_next_states.
+struct ClockUpdate {
+  ClockUpdate(const Model& model_)
+      : model(model_) {
+    if (not model.has_clock()) {
+      throw std::invalid_argument(
+          "Clock updates require a CLOCK variable and PHASE lines");
+    }
+  }
+  void successors(const vector<int>& state, Successors& result) const {
+    result.clear();
+    model.for_each_clock_change(state, [&result](size_t position, int value) {
+      result.add(position, value);
+    });
+  }
+  const Model& model;
+};
+
+#endif /* UPDATEPOLICY_H_ */
@@ -1,3 +1,34 @@
 // Brian Goldman
 // Support tools
 #include "Utilities.h"
+#include <cmath>
+#include <algorithm>
+
+double unseen_probability(std::size_t singletons, std::size_t observations) {
+  return std::min(1.0, (singletons + 1.0) / (observations + 1.0));
+}
+
+std::pair<double, double> wilson_interval(std::size_t successes,
+                                          std::size_t trials,
+                                          double confidence) {
+  if (trials == 0) {
+    return {0, 1};
+  }
+  // Find the normal quantile z where erfc(z / sqrt(2)) == 1 - confidence
+  double low = 0, high = 40;
+  for (int i = 0; i < 100; i++) {
+    double z = (low + high) / 2;
+    if (std::erfc(z / std::sqrt(2.0)) > 1 - confidence) {
+      low = z;
+    } else {
+      high = z;
+    }
+  }
+  double z = (low + high) / 2;
+  double n = trials;
+  double p = successes / n;
+  double center = (p + z * z / (2 * n)) / (1 + z * z / n);
+  double spread = z * std::sqrt(p * (1 - p) / n + z * z / (4 * n * n))
+      / (1 + z * z / n);
+  return {std::max(0.0, center - spread), std::min(1.0, center + spread)};
+}
@@ -8,6 +8,20 @@
 #include <random>
 using Random=std::mt19937;
 
+#include <utility>
+#include <cstddef>
+
+// Good-Turing estimate of the probability that the next observation is of a kind
+// never observed before, given "singletons" kinds were observed exactly once out of
+// "observations" total. Uses add-one smoothing so it is cautious with few observations.
+double unseen_probability(std::size_t singletons, std::size_t observations);
+
+// Wilson score interval for a proportion of "successes" out of "trials" at the
+// given two sided "confidence", e.g. 0.95.
+std::pair<double, double> wilson_interval(std::size_t successes,
+                                          std::size_t trials,
+                                          double confidence);
+
 // This is taken from Boost to allow for hashing of vector<int>
 template<class T>
 inline void hash_combine(std::size_t & seed, const T & v) {
@@ -6,51 +6,65 @@
  */
 
 #include "WalkCycle.h"
+#include "StateWriter.h"
 #include <iostream>
 using std::cout;
 using std::endl;
 #include <cassert>
 #include <unordered_set>
 #include <algorithm>
+#include <thread>
 
-void WalkCycle::print(std::ostream& out) {
+template<typename Update>
+void WalkCycle<Update>::print(std::ostream& out) {
+  StateWriter writer(model, out);
   for (size_t i = 0; i < cycles.size(); i++) {
     for (const auto & state : cycles[i]) {
-      model.print(state, out);
+      writer.write(state);
     }
+    writer.flush();
     out << endl;
   }
   cout << "Total found: " << cycles.size() << endl;
   out << "# Total found: " << cycles.size() << endl;
+  if (confidence > 0) {
+    out << "# Unseen probability: " << unseen_probability() << endl;
+  }
   // Everything below here is a hack to print edge frequency
   // to the screen
-  unordered_map<vector<int>, size_t> frequency;
+  StateMap<size_t> frequency(packer);
   for (const auto & cycle : cycles) {
     for (const auto & state : cycle) {
       frequency[state]++;
     }
   }
   vector<std::pair<double, vector<int>>>sortable;
-  for (const auto & pair : seen_count) {
-    sortable.emplace_back(pair.second, pair.first);
-    if (sortable.back().first < 100) {
-      sortable.pop_back();
+  seen_count.for_each([&sortable](const vector<int>& state, size_t seen) {
+    if (seen >= 100) {
+      sortable.emplace_back(seen, state);
     }
-  }
+  });
   sort(sortable.begin(), sortable.end());
   for (const auto pair : sortable) {
     cout << pair.first << ", ";
     model.print(pair.second, cout);
-    for (const auto edge : edge_frequency.at(pair.second)) {
-      cout << edge.second << ", ";
-      model.print(edge.first, cout);
+    // Every possible transition is regenerated from the state and its column
+    size_t id = edge_frequency.find(pair.second);
+    vector<int> next(pair.second);
+    update.successors(next, options);
+    for (size_t i = 0; i < options.size(); i++) {
+      options.apply(i, next);
+      cout << edge_frequency.at(id, edge_frequency.column(pair.second, next)) << ", ";
+      model.print(next, cout);
+      options.apply(i, next);
     }
     cout << endl;
   }
   cout << "Found cycle states: " << seen_count.size() << endl;
 }
 
-bool WalkCycle::cort_cycle_check(const vector<vector<int>> & cycle) const {
+template<typename Update>
+bool WalkCycle<Update>::cort_cycle_check(const vector<vector<int>> & cycle) const {
   // Find which position in the state is "CORT"
   size_t cort_position = model.find_position("CORT");
   assert(cort_position < model.size());
@@ -64,28 +78,31 @@ bool WalkCycle::cort_cycle_check(const vector<vector<int>> & cycle) const {
   return cort_values.size() > 1;
 }
 
-void WalkCycle::record_edges(vector<vector<int>> & cycle) {
+template<typename Update>
+void WalkCycle<Update>::record_edges(vector<vector<int>> & cycle) {
   for (size_t i = 0; i < cycle.size(); i++) {
     // Look at the transition in this cycle
     auto & from = cycle[i];
     auto & to = cycle[(i + 1) % cycle.size()];
-    auto freq = edge_frequency.find(from);
-    if (freq == edge_frequency.end()) {
-      auto& in_table = edge_frequency[from];
+    auto known = edge_frequency.insert(from);
+    if (known.second) {
       // Never seen this state before, so note all o fits possible edges
-      for (const auto& next : model.get_async_next_states(from)) {
-        in_table[next] = 0;
+      update.successors(from, options);
+      for (size_t j = 0; j < options.size(); j++) {
+        size_t column = options.changed(j) == 1 ? options.position(j) : model.size();
+        edge_frequency.at(known.first, column) = 0;
       }
-      freq = edge_frequency.find(from);
     }
-    // increments edge_frequency[from][to]
-    freq->second[to]++;
+    // increments the count of from -> to
+    edge_frequency.add(known.first, edge_frequency.column(from, to));
   }
 }
 
-void WalkCycle::iterate() {
+template<typename Update>
+void WalkCycle<Update>::iterate() {
   vector<int> start;
-  if (not needs_grind.empty()) {
+  bool random_start = needs_grind.empty();
+  if (not random_start) {
     // Start from a node that we know needs exploring
     start = needs_grind.back();
     grind_count.back()++;
@@ -98,6 +115,11 @@ void WalkCycle::iterate() {
     // Try to find a brand new cycle
     start = model.random_states(random);
   }
+  explore(start, random_start);
+}
+
+template<typename Update>
+void WalkCycle<Update>::explore(const vector<int>& start, bool random_start) {
   auto cycle = walk_until_cycle(start);
   // If you found a cycle
   if (not cycle.empty()) {
@@ -106,9 +128,15 @@ void WalkCycle::iterate() {
       record_edges(cycle);
       cycles.emplace_back(cycle);
       for (const auto & step : cycle) {
-        seen_count[step]++;
+        size_t seen = ++seen_count[step];
+        if (random_start) {
+          size_t sampled = ++sampled_count[step];
+          observations++;
+          singletons += sampled == 1;
+          singletons -= sampled == 2;
+        }
         // If this is the first time you've seen that node
-        if (seen_count[step] == 1) {
+        if (seen == 1) {
           // You want to restart from here later
           needs_grind.push_back(step);
           grind_count.push_back(0);
@@ -118,14 +146,113 @@ void WalkCycle::iterate() {
   }
 }
 
-vector<vector<int>> WalkCycle::walk_until_cycle(const vector<int>& start) {
+template<typename Update>
+void WalkCycle<Update>::sample(size_t iterations, size_t threads, unsigned seed) {
+  threads = std::max<size_t>(threads, 1);
+  if (threads == 1) {
+    std::seed_seq sequence = { seed, 0u };
+    random.seed(sequence);
+    for (size_t i = 0; i < iterations; i++) {
+      if (i % 1000 == 0) {
+        if (i > 0 and confident()) {
+          cout << "Confidence reached after " << i << " iterations" << endl;
+          break;
+        }
+        cout << "Starting iteration: " << i << endl;
+      }
+      iterate();
+    }
+    return;
+  }
+  vector<Random> streams;
+  for (size_t t = 0; t < threads; t++) {
+    std::seed_seq sequence = { seed, unsigned(t) };
+    streams.emplace_back(sequence);
+  }
+  const size_t round = 1000 * threads;
+  size_t done = 0;
+  while (done < iterations) {
+    // Decide where every walk this round starts, with an empty start meaning random.
+    // Restarts come from the back of "needs_grind" just like "iterate".
+    size_t count = std::min(round, iterations - done);
+    vector<vector<int>> starts;
+    while (starts.size() < count and not needs_grind.empty()) {
+      size_t repeats = std::min(1000 - grind_count.back(), count - starts.size());
+      starts.insert(starts.end(), repeats, needs_grind.back());
+      grind_count.back() += repeats;
+      if (grind_count.back() >= 1000) {
+        grind_count.pop_back();
+        needs_grind.pop_back();
+      }
+    }
+    starts.resize(count);
+    // Reserved up front since each worker's tables point at its own packer
+    vector<WalkCycle> workers;
+    workers.reserve(threads);
+    for (size_t t = 0; t < threads; t++) {
+      workers.emplace_back(model, streams[t], stack_limit);
+    }
+    vector<std::thread> running;
+    for (size_t t = 0; t < threads; t++) {
+      running.emplace_back([&workers, &starts, t, threads]() {
+        auto & worker = workers[t];
+        for (size_t i = t; i < starts.size(); i += threads) {
+          if (starts[i].empty()) {
+            worker.explore(worker.model.random_states(worker.random), true);
+          } else {
+            worker.explore(starts[i], false);
+          }
+        }
+      });
+    }
+    for (auto & thread : running) {
+      thread.join();
+    }
+    for (const auto & worker : workers) {
+      merge(worker);
+    }
+    done += count;
+    cout << "Completed iterations: " << done << " Cycles: " << cycles.size()
+         << endl;
+    // Only checked between rounds so the result doesn't depend on timing
+    if (confident()) {
+      cout << "Confidence reached after " << done << " iterations" << endl;
+      break;
+    }
+  }
+}
+
+template<typename Update>
+void WalkCycle<Update>::merge(const WalkCycle& worker) {
+  cycles.insert(cycles.end(), worker.cycles.begin(), worker.cycles.end());
+  worker.sampled_count.for_each([this](const vector<int>& state, size_t added) {
+    size_t& sampled = sampled_count[state];
+    singletons -= sampled == 1;
+    sampled += added;
+    singletons += sampled == 1;
+    observations += added;
+  });
+  worker.seen_count.for_each([this](const vector<int>& state, size_t added) {
+    size_t& seen = seen_count[state];
+    seen += added;
+    // Newly found cycle states get restarted from in later rounds
+    if (seen == added) {
+      needs_grind.push_back(state);
+      grind_count.push_back(0);
+    }
+  });
+  edge_frequency.merge(worker.edge_frequency);
+}
+
+template<typename Update>
+vector<vector<int>> WalkCycle<Update>::walk_until_cycle(const vector<int>& start) {
   vector<vector<int>> path;
   path.emplace_back(start);
-  unordered_map<vector<int>, size_t> path_position;
+  StateMap<size_t> path_position(packer);
   do {
     // Assign the previous back to a position
     path_position[path.back()] = path.size() - 1;
-    auto options = model.get_async_next_states(path.back());
+    update.successors(path.back(), options);
     if (options.empty()) {
       // You have reached a steady state, time to bail
       return {};
@@ -134,7 +261,8 @@ vector<vector<int>> WalkCycle::walk_until_cycle(const vector<int>& start) {
     std::uniform_int_distribution<size_t> dist(0, options.size() - 1);
     // pick one at random
     size_t choice = dist(random);
-    path.push_back(options[choice]);
+    path.push_back(path.back());
+    options.apply(choice, path.back());
     // Stop when the new back already has a position, or if the path gets too long
   } while (path_position.count(path.back()) == 0 and path.size() < stack_limit);
   if (path.size() >= stack_limit) {
@@ -143,8 +271,13 @@ vector<vector<int>> WalkCycle::walk_until_cycle(const vector<int>& start) {
   }
   // At this point you know path.back() is in path twice. Everything
   // between those points is the cycle
-  size_t repeated = path_position[path.back()];
+  size_t repeated = *path_position.find(path.back());
   // Only have one copy of the repeated variable
   vector<vector<int>> cycle(path.begin() + repeated + 1, path.end());
   return cycle;
 }
+
+// Compile the engine for each update scheme
+template class WalkCycle<SyncUpdate>;
+template class WalkCycle<AsyncUpdate>;
+template class WalkCycle<ClockUpdate>;
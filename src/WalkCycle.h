@@ -4,6 +4,7 @@
 // record that as a cycle. Outputs all found cycles. It will
 // also attempt to start from every state it thinks is part
 // of a cycle 1000 times and count how often that state.
+// The "Update" template parameter selects the update scheme, see UpdatePolicy.h
 #ifndef WALKCYCLE_H_
 #define WALKCYCLE_H_
 #include <vector>
@@ -12,7 +13,10 @@ using std::vector;
 using std::unordered_set;
 
 #include "Model.h"
+#include "PackedState.h"
+#include "UpdatePolicy.h"
 
+template<typename Update>
 class WalkCycle {
  public:
   // stack_limit is designed to prevent excessive memory usage by stopping walks
@@ -20,18 +24,49 @@ class WalkCycle {
   WalkCycle(const Model& model_, Random & random_, size_t stack_limit_)
       : model(model_),
         random(random_),
-        stack_limit(stack_limit_) {
+        stack_limit(stack_limit_),
+        update(model_),
+        packer(model_),
+        seen_count(packer),
+        sampled_count(packer),
+        singletons(0),
+        observations(0),
+        confidence(0),
+        edge_frequency(packer) {
   }
   ;
   // Performs a random walk until that walk loops back on itself and records
   // information about the walk. Starts either from a random state or from
   // a previous state that was part of a cycle
   void iterate();
+  // Performs "iterations" walks using "threads" workers, each with its own random
+  // stream derived from "seed". Work is done in rounds, where the restarts from
+  // cycle states and then new random starts are split between the workers, and each
+  // worker's cycles, counts and edges are merged in worker order after the round.
+  // This keeps the results dependent only on "seed" and "threads".
+  void sample(size_t iterations, size_t threads, unsigned seed);
   void print(std::ostream& out);
+  // Good-Turing estimate of the probability that the next cycle state recorded
+  // by a walk from a random state has never been recorded by one before
+  double unseen_probability() const {
+    return ::unseen_probability(singletons, observations);
+  }
+  // If "confidence_" is above 0, "confident" returns true once "unseen_probability"
+  // is at most 1 - confidence_
+  void set_confidence(double confidence_) {
+    confidence = confidence_;
+  }
+  bool confident() const {
+    return confidence > 0 and unseen_probability() <= 1 - confidence;
+  }
  private:
   const Model& model;
   Random& random;
   size_t stack_limit;
+  // Generates the successors of each state
+  Update update;
+  // Reused for every state's successors so walking doesn't allocate
+  Successors options;
   // A vector cycles, where each cycle is a vector of states
   // where each state is a vector of ints.
   vector<vector<vector<int>>> cycles;
@@ -39,16 +74,29 @@ class WalkCycle {
   // you've already seen during this walk. Returns an empty vector if you
   // reach a steady state
   vector<vector<int>> walk_until_cycle(const vector<int>& start);
+  // Walks from "start" and records the cycle found, if any. Only walks from
+  // a "random_start" are independent samples for the unseen estimate.
+  void explore(const vector<int>& start, bool random_start);
+  // Adds everything "worker" found during a round
+  void merge(const WalkCycle& worker);
 
+  // Converts states into compact keys for hash tables
+  StatePacker packer;
   // Used to track if a state needs further exploration of its edges
   vector<vector<int>> needs_grind;
   vector<size_t> grind_count;
-  unordered_map<vector<int>, size_t> seen_count;
+  StateMap<size_t> seen_count;
+  // Times each cycle state was recorded by a walk from a random state. Restarts
+  // from known cycle states would otherwise make every state look common.
+  StateMap<size_t> sampled_count;
+  // How many states in "sampled_count" were seen exactly once, and the total of "sampled_count"
+  size_t singletons;
+  size_t observations;
+  double confidence;
   // Given a cycle, update edge_frequency
   void record_edges(vector<vector<int>> & cycle);
-  // edge_frequency[X][Y] is how often a transition from X to Y was found
-  // to be part of a cort cycle
-  unordered_map<vector<int>, unordered_map<vector<int>, size_t>> edge_frequency;
+  // How often each transition was found to be part of a cort cycle
+  EdgeCounts edge_frequency;
   // Determines if this cycle contains at least two unique levels of CORT
   bool cort_cycle_check(const vector<vector<int>> & cycle) const;
 };
@@ -10,17 +10,86 @@
 // Release/run FOCUS.txt out.txt 0
 // This will use the model from "FOCUS.txt" and write its output to "out.txt"
 // performing operation "0", which corresponds to finding all stable states.
+// Optional flags can follow the operation number, for example:
+// Release/run FOCUS.txt out.txt 0 -threads 8
 
 #include "Model.h"
 #include "Enumeration.h"
+#include "Decomposition.h"
 #include "Cycles.h"
+#include "SyncGraph.h"
 #include "MonteCarloCycles.h"
 #include "WalkCycle.h"
+#include "StateWriter.h"
+#include "PackedState.h"
+#include "UpdatePolicy.h"
 
 #include <iostream>
 using namespace std;
 #include <cassert>
 #include <fstream>
+#include <sstream>
+#include <thread>
+#include <unordered_set>
+#include <unistd.h>
+
+// Option 2: sampled Tarjan using "Update" to generate successors
+template<typename Update>
+void sample_tarjan(const Model& model, ostream& out, size_t iterations,
+                   size_t threads, unsigned seed, double confidence,
+                   size_t cache_limit) {
+  Random random;
+  MonteCarloCycles<Update> cycle_finder(model, random, 5000000);
+  cycle_finder.set_confidence(confidence);
+  cycle_finder.set_cache_limit(cache_limit);
+  cycle_finder.sample(iterations, threads, seed);
+  cycle_finder.print(out);
+}
+
+// Option 3: random walks using "Update" to generate successors
+template<typename Update>
+void walk_cycles(const Model& model, ostream& out, size_t iterations,
+                 size_t threads, unsigned seed, double confidence) {
+  Random random;
+  WalkCycle<Update> cycle_finder(model, random, 500000);
+  cycle_finder.set_confidence(confidence);
+  cycle_finder.sample(iterations, threads, seed);
+  cycle_finder.print(out);
+}
+
+// Option 4: writes every transition out of the states in "in" using the GraphViz format
+template<typename Update>
+void write_graphviz(const Model& model, istream& in, ostream& out,
+                    StateWriter::Format format) {
+  Update update(model);
+  out << "digraph test {" << endl;
+  out << "overlap=scalexy" << endl;
+  string line;
+  StatePacker packer(model);
+  StateSet starts(packer), ends(packer);
+  vector<int> states;
+  Successors successors;
+  while (format == StateWriter::BINARY ?
+      model.load_binary_state(in, states) : bool(getline(in, line))) {
+    if (format == StateWriter::TEXT) {
+      states = model.load_state(line);
+    }
+    starts.insert(states);
+    update.successors(states, successors);
+    for (size_t i = 0; i < successors.size(); i++) {
+      model.print(states, out);
+      out << " -> ";
+      // Print the neighbor by changing "states" in place, then change it back
+      successors.apply(i, states);
+      ends.insert(states);
+      model.print(states, out);
+      successors.apply(i, states);
+      out << ";" << endl;
+    }
+  }
+  out << "}" << endl;
+  cout << starts.size() << " " << ends.size() << endl;
+}
 
 int main(int argc, char * argv[]) {
   if (argc < 3) {
@@ -32,6 +101,79 @@ int main(int argc, char * argv[]) {
         << "Example: Release/run input.txt output.txt"
         << endl
         << "         This will read a problem from input.txt, write local optima to output.txt"
+        << endl
+        << "         Files ending in .csv are adjacency matrices, .edges are sparse edge lists"
+        << endl
+        << "         (see Model.h) and .hmodel are compiled models (see -model-cache)"
+        << endl
+        << endl
+        << "Flags may follow the tool number:"
+        << endl
+        << "  -threads N    Number of worker threads, 0 uses every core (tools 0-3 and 5)"
+        << endl
+        << "  -checkpoint F Periodically save progress to file F (tool 0)"
+        << endl
+        << "  -checkpoint-seconds S  Seconds between checkpoints, default 60"
+        << endl
+        << "  -resume       Continue from the -checkpoint file, appending to output_filename"
+        << endl
+        << "  -ordering O   Variable ordering: greedy (default), deterministic,"
+        << endl
+        << "                min-degree, min-fill or cuthill-mckee. deterministic is"
+        << endl
+        << "                fastest to compute for models with many thousands of variables,"
+        << endl
+        << "                but breaks ties differently from greedy, so tool 0 may prune"
+        << endl
+        << "                less and search more (FOCUS.txt: 921 iterations against 313)"
+        << endl
+        << "  -model-cache F  Load the compiled model from F, or save it there if F is"
+        << endl
+        << "                missing or out of date. F can later be the input_filename."
+        << endl
+        << "  -telemetry F  Append a JSON line describing progress to file F (tool 0)"
+        << endl
+        << "  -telemetry-seconds S   Seconds between progress reports, default 10"
+        << endl
+        << "  -format F     State format for tool 0 output and tool 4 input: text (default) or binary"
+        << endl
+        << "  -clamp C      Comma separated list of NAME=VALUE or NAME=LOW..HIGH to fix (tool 0)"
+        << endl
+        << "  -count-only   Count stable states without writing them (tool 0)"
+        << endl
+        << "  -decompose    Enumerate each independent sub-network separately and"
+        << endl
+        << "                write their stable states in factored form (tool 0)"
+        << endl
+        << "  -expand       With -decompose, write every stable state of the full model"
+        << endl
+        << "  -dense        Track visited states with a bitmap, allowing -threads, with"
+        << endl
+        << "                each cycle written from its lowest state (tool 1)"
+        << endl
+        << "  -successor-file F  Reuse the successor table in F, creating it if needed (tool 5)"
+        << endl
+        << "  -iterations N Maximum number of samples to take, default 100000 for tool 2"
+        << endl
+        << "                and 1000000 for tool 3"
+        << endl
+        << "  -confidence C Stop once the estimated chance of finding anything new is"
+        << endl
+        << "                at most 1 - C, e.g. 0.999 (tools 2 and 3)"
+        << endl
+        << "  -seed S       Seed for the random number streams, default 0 for tool 2"
+        << endl
+        << "                and random for tool 3"
+        << endl
+        << "  -cache-states N  Remember at most N transient states and the cycle they"
+        << endl
+        << "                lead to, default 1048576, 0 to disable (tool 2)"
+        << endl
+        << "  -update U     Update scheme: sync, async or clock. Defaults to clock for"
+        << endl
+        << "                tools 2 and 4, and async for tool 3. clock needs a CLOCK variable"
+        << endl
+        << "                and lines like \"PHASE 1 CRH ACTH\" giving when each variable updates"
         << endl;
     return 0;
   }
@@ -41,83 +183,286 @@ int main(int argc, char * argv[]) {
   if (argc > 3) {
     option = atoi(argv[3]);
   }
+  // Anything of the form "-name value" is a flag, everything else is positional.
+  // Boolean flags never take a value, while every other flag always takes the
+  // next argument so values such as "-seed -1" work.
+  const std::unordered_set<string> boolean_flags = { "count-only", "decompose", "dense",
+      "expand", "resume" };
+  unordered_map<string, string> flags;
+  vector<string> positional;
+  for (int i = 4; i < argc; i++) {
+    string arg = argv[i];
+    if (arg.size() > 1 and arg[0] == '-') {
+      string name = arg.substr(1);
+      string value = "1";
+      if (not boolean_flags.count(name)) {
+        if (i + 1 >= argc) {
+          cout << "Missing value for " << arg << endl;
+          return 1;
+        }
+        value = argv[++i];
+      }
+      flags[name] = value;
+    } else {
+      positional.push_back(arg);
+    }
+  }
+  size_t threads = 1;
+  if (flags.count("threads")) {
+    threads = atoi(flags["threads"].c_str());
+    if (threads == 0) {
+      threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+  }
 
   // Start the timer
   auto start = std::chrono::steady_clock::now();
-  // Read in the model
-  Model model(problem_file);
-  // Open the output file for writing
-  ofstream out(output_file);
+  string ordering = "greedy";
+  if (flags.count("ordering")) {
+    ordering = flags["ordering"];
+    if (not Model::known_ordering(ordering)) {
+      cout << "Unknown variable ordering: " << ordering << ", use greedy, deterministic,"
+           << " min-degree, min-fill or cuthill-mckee" << endl;
+      return 1;
+    }
+  }
+  auto format = StateWriter::TEXT;
+  if (flags.count("format")) {
+    if (not StateWriter::known_format(flags["format"])) {
+      cout << "Unknown state format: " << flags["format"] << ", use text or binary"
+           << endl;
+      return 1;
+    }
+    format = StateWriter::parse_format(flags["format"]);
+  }
+  // Read in the model, reusing a compiled copy if one was requested
+  string model_cache;
+  if (flags.count("model-cache")) {
+    model_cache = flags["model-cache"];
+  }
+  Model model(problem_file, ordering, model_cache);
+  bool resume = flags.count("resume");
+  if (resume and (option != 0 or not flags.count("checkpoint"))) {
+    cout << "-resume requires tool 0 and a -checkpoint file" << endl;
+    return 1;
+  }
+  if (flags.count("checkpoint") and threads > 1) {
+    cout << "Checkpoints require -threads 1" << endl;
+    return 1;
+  }
+  // Open the output file for writing. Resuming opens it once the
+  // checkpoint is known to match this run.
+  ofstream out;
+  if (not resume) {
+    out.open(output_file);
+  }
   if (option == 0) {
     cout << "You chose option 0: Finding all stable states" << endl;
-    Enumeration enumerate(model);
-    enumerate.enumerate(out);
+    // Each clamp is NAME=VALUE or NAME=LOW..HIGH
+    vector<string> clamp_names;
+    vector<std::pair<int, int>> clamp_ranges;
+    if (flags.count("clamp")) {
+      istringstream clamps(flags["clamp"]);
+      string clamp;
+      while (getline(clamps, clamp, ',')) {
+        auto equals = clamp.find('=');
+        size_t position = equals == string::npos ?
+            model.size() : model.find_position(clamp.substr(0, equals));
+        if (position >= model.size()) {
+          cout << "Unable to clamp: " << clamp << endl;
+          return 1;
+        }
+        string range = clamp.substr(equals + 1);
+        auto dots = range.find("..");
+        int low = atoi(range.substr(0, dots).c_str());
+        int high = low;
+        if (dots != string::npos) {
+          high = atoi(range.substr(dots + 2).c_str());
+        }
+        const auto & interaction = model.get_interactions()[position];
+        if (low > high or low < interaction.lower_bound
+            or high > interaction.upper_bound) {
+          cout << "Unable to clamp: " << clamp << ", " << interaction.target_name
+               << " takes values " << interaction.lower_bound << ".."
+               << interaction.upper_bound << endl;
+          return 1;
+        }
+        clamp_names.push_back(clamp.substr(0, equals));
+        clamp_ranges.emplace_back(low, high);
+      }
+    }
+    if (flags.count("decompose")) {
+      if (flags.count("checkpoint") or flags.count("count-only")) {
+        cout << "-decompose does not support -checkpoint or -count-only" << endl;
+        return 1;
+      }
+      if (format != StateWriter::TEXT and not flags.count("expand")) {
+        cout << "-decompose without -expand writes factored output, which is only"
+             << " available with -format text" << endl;
+        return 1;
+      }
+      Decomposition decomposition(model, ordering);
+      for (size_t i = 0; i < clamp_names.size(); i++) {
+        decomposition.clamp(clamp_names[i], clamp_ranges[i].first,
+                            clamp_ranges[i].second);
+      }
+      decomposition.enumerate(out, threads, flags.count("expand"), format);
+    } else {
+      Enumeration enumerate(model);
+      enumerate.set_format(format);
+      enumerate.set_count_only(flags.count("count-only"));
+      for (size_t i = 0; i < clamp_names.size(); i++) {
+        enumerate.clamp(model.find_position(clamp_names[i]),
+                        clamp_ranges[i].first, clamp_ranges[i].second);
+      }
+      if (flags.count("checkpoint")) {
+        double seconds = 60;
+        if (flags.count("checkpoint-seconds")) {
+          seconds = atof(flags["checkpoint-seconds"].c_str());
+        }
+        enumerate.set_checkpoint(flags["checkpoint"], seconds);
+      }
+      double report_seconds = 10;
+      if (flags.count("telemetry-seconds")) {
+        report_seconds = atof(flags["telemetry-seconds"].c_str());
+      }
+      enumerate.set_telemetry(flags["telemetry"], report_seconds);
+      if (resume) {
+        // Throw away anything written after the checkpoint was saved
+        size_t offset = enumerate.checkpoint_offset(flags["checkpoint"]);
+        if (truncate(output_file.c_str(), offset) != 0) {
+          cout << "Unable to truncate " << output_file << endl;
+          return 1;
+        }
+        out.open(output_file, ios::in | ios::out);
+        out.seekp(offset);
+        enumerate.resume(out, flags["checkpoint"]);
+      } else {
+        enumerate.enumerate(out, threads);
+      }
+    }
   } else if (option == 1) {
     cout << "You chose option 1: Use synchronous updates and "
          <<  "start from all states to see if they are cycles"
          << endl;
     Cycles cycle_finder(model);
-    cycle_finder.find_cycles(out);
-  } else if (option == 2) {
-    cout << "You chose option 2: Using sampled Tarjan "
-         << "to find strongly connected components"
-         << endl;
-    Random random;
-    MonteCarloCycles cycle_finder(model, random, 500000);
-    for (int i = 0; i < 100000; i++) {
-      if (i % 1000 == 0) {
-        cout << "Starting iteration: " << i << endl;
-      }
-      cycle_finder.iterate();
-    }
-    cycle_finder.print(out);
-  } else if (option == 3) {
-    cout << "You chose option 3: Perform random walks and "
-         << "record each type you get a cycle"
-         << endl;
-    Random random;
-    random.seed(std::random_device()());
-    WalkCycle cycle_finder(model, random, 500000);
-    for (int i = 0; i < 1000000; i++) {
-      if (i % 1000 == 0) {
-        cout << "Starting iteration: " << i << endl;
-      }
-      cycle_finder.iterate();
-    }
-    cycle_finder.print(out);
-  } else if (option == 4) {
-    if (argc < 5) {
-      cout << "Option 4 requires another argument: the cycle input file"
-           << endl;
+    if (flags.count("dense")) {
+      if (not Cycles::dense_supported(model)) {
+        cout << "The state space is too large for -dense" << endl;
+        return 1;
+      }
+      cycle_finder.find_cycles_dense(out, threads);
+    } else {
+      cycle_finder.find_cycles(out);
+    }
+  } else if (option >= 2 and option <= 4) {
+    // Each of these tools is compiled once per update scheme
+    string update = option == 3 ? "async" : "clock";
+    if (flags.count("update")) {
+      update = flags["update"];
+    }
+    if (update != "sync" and update != "async" and update != "clock") {
+      cout << "Unknown update scheme: " << update << endl;
+      return 1;
+    }
+    if (update == "clock" and not model.has_clock()) {
+      cout << "Clock updates require a CLOCK variable and PHASE lines giving the"
+           << " variables that update in each phase. Use -update async or sync"
+           << " for models without them." << endl;
       return 1;
     }
-    cout << "You chose option 4: Convert a cycle into the GraphViz format"
+    // Options 2 and 3 can stop early once they are confident nothing is left to find
+    size_t iterations = option == 2 ? 100000 : 1000000;
+    if (flags.count("iterations")) {
+      iterations = atol(flags["iterations"].c_str());
+    }
+    double confidence = 0;
+    if (flags.count("confidence")) {
+      confidence = atof(flags["confidence"].c_str());
+    }
+    // Sampled Tarjan is reproducible by default, random walks are not
+    unsigned seed = option == 3 ? std::random_device()() : 0;
+    if (flags.count("seed")) {
+      seed = atol(flags["seed"].c_str());
+    }
+    if (option == 2) {
+      cout << "You chose option 2: Using sampled Tarjan "
+           << "to find strongly connected components"
+           << endl;
+      size_t cache_limit = 1 << 20;
+      if (flags.count("cache-states")) {
+        cache_limit = atol(flags["cache-states"].c_str());
+      }
+      if (update == "sync") {
+        sample_tarjan<SyncUpdate>(model, out, iterations, threads, seed,
+                                  confidence, cache_limit);
+      } else if (update == "async") {
+        sample_tarjan<AsyncUpdate>(model, out, iterations, threads, seed,
+                                  confidence, cache_limit);
+      } else {
+        sample_tarjan<ClockUpdate>(model, out, iterations, threads, seed,
+                                  confidence, cache_limit);
+      }
+    } else if (option == 3) {
+      cout << "You chose option 3: Perform random walks and "
+           << "record each type you get a cycle"
+           << endl;
+      if (update == "sync") {
+        walk_cycles<SyncUpdate>(model, out, iterations, threads, seed,
+                                confidence);
+      } else if (update == "async") {
+        walk_cycles<AsyncUpdate>(model, out, iterations, threads, seed,
+                                 confidence);
+      } else {
+        walk_cycles<ClockUpdate>(model, out, iterations, threads, seed,
+                                 confidence);
+      }
+    } else {
+      if (positional.empty()) {
+        cout << "Option 4 requires another argument: the cycle input file"
+             << endl;
+        return 1;
+      }
+      cout << "You chose option 4: Convert a cycle into the GraphViz format"
+           << endl;
+      ifstream in(positional[0]);
+      if (update == "sync") {
+        write_graphviz<SyncUpdate>(model, in, out, format);
+      } else if (update == "async") {
+        write_graphviz<AsyncUpdate>(model, in, out, format);
+      } else {
+        write_graphviz<ClockUpdate>(model, in, out, format);
+      }
+    }
+  } else if (option == 5) {
+    cout << "You chose option 5: Use a table of every synchronous update to "
+         << "find all attractors and their basin sizes"
          << endl;
-    ifstream in(argv[4]);
-    out << "digraph test {" << endl;
-    out << "overlap=scalexy" << endl;
-    string line;
-    unordered_set<vector<int>> starts, ends;
-    while (getline(in, line)) {
-      vector<int> states = model.load_state(line);
-      starts.insert(states);
-      for (const auto & neighbor : model.get_clock_next_states(states)) {
-        ends.insert(neighbor);
-        model.print(states, out);
-        out << " -> ";
-        model.print(neighbor, out);
-        out << ";" << endl;
-      }
-    }
-    out << "}" << endl;
-    cout << starts.size() << " " << ends.size() << endl;
+    if (not SyncGraph::supported(model)) {
+      cout << "The state space is too large for option 5" << endl;
+      return 1;
+    }
+    SyncGraph graph(model);
+    string table_file = flags["successor-file"];
+    if (table_file.empty() or not graph.load(table_file)) {
+      graph.build(threads);
+      if (not table_file.empty()) {
+        graph.save(table_file);
+      }
+    } else {
+      cout << "Loaded successor table: " << table_file << endl;
+    }
+    graph.find_attractors(out);
   } else {
     cout << "You chose an option that doesn't exist: " << option << endl;
     return 1;
   }
   auto end = std::chrono::steady_clock::now();
   double seconds = std::chrono::duration<double>(end - start).count();
-  out << "# Seconds: " << seconds << endl;
+  // Binary output can only contain states
+  if (option != 0 or format == StateWriter::TEXT) {
+    out << "# Seconds: " << seconds << endl;
+  }
   cout << "Done. Total Seconds: " << seconds << endl;
   return 0;
 }
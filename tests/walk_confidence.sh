@@ -0,0 +1,23 @@
+#!/bin/sh
+# Brian Goldman
+# Random walks with -confidence must not stop while restarts from known cycle
+# states are still finding new ones, so stopping early has to find just as many
+# cycle states as walking for every iteration.
+# Usage: tests/walk_confidence.sh path/to/run
+run=${1:-Release/run}
+dir=$(dirname "$0")
+out=$(mktemp)
+trap 'rm -f "$out"' EXIT
+
+states() {
+  "$run" "$dir/../FOCUS-Clock.txt" "$out" 3 -seed 1 -iterations 200000 "$@" \
+    | grep "Found cycle states" | cut -d' ' -f4
+}
+
+expected=$(states)
+found=$(states -confidence 0.99)
+if [ -z "$expected" ] || [ "$found" != "$expected" ]; then
+  echo "FAIL: -confidence 0.99 found $found cycle states, all 200000 walks found $expected"
+  exit 1
+fi
+echo "PASS: -confidence 0.99 found all $expected cycle states"